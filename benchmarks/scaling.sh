@@ -0,0 +1,27 @@
+#!/bin/sh
+# Renders the same scene with 1, 2, 4, ... threads and prints the speedup over a single thread.
+# Usage: benchmarks/scaling.sh <path to main> <max threads> [render options, e.g. --numa --replicate-scene]
+set -e
+
+MAIN=${1:?path to the main executable}
+MAX_THREADS=${2:-$(nproc)}
+if [ $# -ge 2 ]; then shift 2; else shift $#; fi
+
+render_ms() {
+    n=$1
+    shift
+    "$MAIN" --threads "$n" "$@" 2>/dev/null | tr '\r' '\n' | sed -n 's/.*Processing time: \([0-9]*\)\[ms\].*/\1/p'
+}
+
+echo "threads  time[ms]  speedup"
+threads=1
+while [ "$threads" -le "$MAX_THREADS" ]; do
+    ms=$(render_ms "$threads" "$@")
+    [ -z "$base" ] && base=$ms
+    echo "$threads $ms $base" | awk '{ printf "%7d  %8d  %7.2f\n", $1, $2, $3 / $2 }'
+    if [ "$threads" -lt "$MAX_THREADS" ] && [ $((threads * 2)) -gt "$MAX_THREADS" ]; then
+        threads=$MAX_THREADS
+    else
+        threads=$((threads * 2))
+    fi
+done
@@ -0,0 +1,81 @@
+#ifndef AABB_H_
+#define AABB_H_
+
+#include <algorithm>
+
+#include "utils.h"
+#include "vec3.h"
+#include "ray.h"
+
+class aabb {
+
+    public:
+        // The default box is empty, growing it by any point or box yields that point or box
+        aabb() : minimum(infinity, infinity, infinity), maximum(-infinity, -infinity, -infinity) {}
+        aabb(const point3& a, const point3& b) : minimum(a), maximum(b) {}
+
+        point3 min() const { return minimum; }
+        point3 max() const { return maximum; }
+
+        bool empty() const {
+            return minimum[0] > maximum[0] || minimum[1] > maximum[1] || minimum[2] > maximum[2];
+        }
+
+        void grow(const aabb& box) {
+            for (int a = 0; a < 3; ++a) {
+                minimum[a] = std::min(minimum[a], box.minimum[a]);
+                maximum[a] = std::max(maximum[a], box.maximum[a]);
+            }
+        }
+
+        void grow(const point3& p) {
+            for (int a = 0; a < 3; ++a) {
+                minimum[a] = std::min(minimum[a], p[a]);
+                maximum[a] = std::max(maximum[a], p[a]);
+            }
+        }
+
+        point3 centroid() const {
+            return 0.5 * (minimum + maximum);
+        }
+
+        double surface_area() const {
+            if (empty()) return 0;
+            const vec3 d = maximum - minimum;
+            return 2. * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+        }
+
+        // Slab test with the precomputed inverse ray direction
+        bool hit(const point3& origin, const vec3& inv_dir, double t_min, double t_max) const {
+            for (int a = 0; a < 3; ++a) {
+                double t0 = (minimum[a] - origin[a]) * inv_dir[a];
+                double t1 = (maximum[a] - origin[a]) * inv_dir[a];
+                if (inv_dir[a] < 0.) std::swap(t0, t1);
+                t_min = t0 > t_min ? t0 : t_min;
+                t_max = t1 < t_max ? t1 : t_max;
+                if (t_max < t_min) return false;
+            }
+            return true;
+        }
+
+    public:
+        point3 minimum;
+        point3 maximum;
+};
+
+inline aabb surrounding_box(const aabb& box0, const aabb& box1) {
+    aabb box(box0);
+    box.grow(box1);
+    return box;
+}
+
+inline aabb intersect_box(const aabb& box0, const aabb& box1) {
+    return aabb(point3(std::max(box0.minimum[0], box1.minimum[0]),
+                       std::max(box0.minimum[1], box1.minimum[1]),
+                       std::max(box0.minimum[2], box1.minimum[2])),
+                point3(std::min(box0.maximum[0], box1.maximum[0]),
+                       std::min(box0.maximum[1], box1.maximum[1]),
+                       std::min(box0.maximum[2], box1.maximum[2])));
+}
+
+#endif
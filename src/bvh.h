@@ -0,0 +1,854 @@
+#ifndef BVH_H_
+#define BVH_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "threading/threadpool.h"
+
+// Build quality vs. build time knob, ordered from fastest build to best tree
+enum class bvh_build_mode {
+    lbvh,  // Morton code linear BVH
+    sah,   // Binned SAH with object splits
+    sbvh   // Binned SAH that also considers spatial splits and splitting off large primitives at every node
+};
+
+struct bvh_build_stats {
+    double build_ms = 0;
+    double sah_cost = 0;
+    size_t nodes = 0;
+    size_t leaves = 0;
+    size_t references = 0;
+};
+
+struct bvh_node {
+    aabb box;
+    uint32_t left;   // Interior: index of the left child. Leaf: first entry in the primitive list
+    uint32_t right;  // Interior: index of the right child
+    uint32_t count;  // Number of primitives, 0 for interior nodes
+    uint32_t axis;   // Split axis, used to visit the nearer child first
+};
+
+// Costs of the surface area heuristic, shared by the builder and the reported tree cost
+const double bvh_traversal_cost = 1.0;
+const double bvh_intersection_cost = 1.0;
+
+// Primitive reference used during the build. With spatial splits a primitive can be referenced by several
+// leaves, each reference then only covers the clipped part of the primitive's box.
+struct bvh_prim_ref {
+    aabb box;
+    uint32_t index;
+    uint32_t code;  // Morton code of the centroid, only used by the LBVH builder
+};
+
+// Top-down BVH builder. The upper levels are split on the calling thread, with binning and partitioning
+// of large nodes spread over the thread pool. Once nodes are small enough, each remaining subtree is built
+// serially by one job and spliced into the node array afterwards.
+class bvh_builder {
+
+    public:
+        bvh_builder(bvh_build_mode build_mode, ThreadPool& pool, const std::vector<shared_ptr<hittable>>& objects)
+            : mode(build_mode), threadpool(pool), prims(objects) {
+            const size_t num_prims = objects.size();
+            // Spatial splits may at most add this fraction of references
+            max_extra_refs = static_cast<size_t>(0.5 * num_prims);
+            subtree_size = std::max<size_t>(4096, num_prims / (8 * std::max<uint32_t>(1, pool.num_threads())));
+        }
+
+        // Builds the tree into nodes and indices. Interior node bounds are left empty, see bvh::refit.
+        void build(std::vector<bvh_prim_ref>& refs, std::vector<bvh_node>& nodes, std::vector<uint32_t>& indices) {
+            nodes.clear();
+            indices.clear();
+            if (refs.empty()) return;
+            if (mode == bvh_build_mode::lbvh) sort_morton(refs);
+            if (mode == bvh_build_mode::sbvh) {
+                aabb bounds;
+                for (const auto& ref : refs) bounds.grow(ref.box);
+                root_area = bounds.surface_area();
+            }
+
+            std::vector<subtree> pending;
+            nodes.resize(1);
+            build_top(refs, 0, 0, max_extra_refs, nodes, indices, pending);
+
+            for (auto& task : pending) {
+                subtree* t = &task;
+                std::function<void()> fun = [this, t] {
+                    t->nodes.resize(1);
+                    build_serial(t->refs, 0, t->depth, t->budget, t->nodes, t->indices);
+                };
+                threadpool.add_job(fun);
+            }
+            threadpool.wait();
+            for (auto& task : pending) splice(task, nodes, indices);
+        }
+
+    private:
+        struct subtree {
+            std::vector<bvh_prim_ref> refs;
+            uint32_t slot;
+            int depth;
+            size_t budget;
+            std::vector<bvh_node> nodes;
+            std::vector<uint32_t> indices;
+        };
+
+        static const int max_depth = 60;
+        static const size_t max_leaf_size = 8;
+        static const size_t lbvh_leaf_size = 4;
+        static const size_t min_chunk_size = 8192;
+        static const int num_bins = 32;
+        // Size bins, i.e. factors of two in surface area, spanned by the large child of a size split
+        static const int size_split_span = 4;
+
+        // budget is the number of references that spatial splits may still add to the subtree
+        void build_top(std::vector<bvh_prim_ref>& refs, uint32_t slot, int depth, size_t budget,
+                       std::vector<bvh_node>& nodes, std::vector<uint32_t>& indices, std::vector<subtree>& pending) {
+            if (refs.size() <= subtree_size) {
+                pending.push_back(subtree());
+                pending.back().refs.swap(refs);
+                pending.back().slot = slot;
+                pending.back().depth = depth;
+                pending.back().budget = budget;
+                return;
+            }
+            std::vector<bvh_prim_ref> left, right;
+            uint32_t axis;
+            if (!split(refs, left, right, axis, depth, budget, true)) {
+                make_leaf(refs, slot, nodes, indices);
+                return;
+            }
+            std::vector<bvh_prim_ref>().swap(refs);
+            const uint32_t l = make_interior(slot, axis, nodes);
+            const size_t left_budget = share_budget(budget, left.size(), right.size());
+            build_top(left, l, depth + 1, left_budget, nodes, indices, pending);
+            build_top(right, l + 1, depth + 1, budget - left_budget, nodes, indices, pending);
+        }
+
+        void build_serial(std::vector<bvh_prim_ref>& refs, uint32_t slot, int depth, size_t budget,
+                          std::vector<bvh_node>& nodes, std::vector<uint32_t>& indices) {
+            std::vector<bvh_prim_ref> left, right;
+            uint32_t axis;
+            if (!split(refs, left, right, axis, depth, budget, false)) {
+                make_leaf(refs, slot, nodes, indices);
+                return;
+            }
+            std::vector<bvh_prim_ref>().swap(refs);
+            const uint32_t l = make_interior(slot, axis, nodes);
+            const size_t left_budget = share_budget(budget, left.size(), right.size());
+            build_serial(left, l, depth + 1, left_budget, nodes, indices);
+            build_serial(right, l + 1, depth + 1, budget - left_budget, nodes, indices);
+        }
+
+        // Share of the budget left by a split that goes to the left child, in proportion to the references. Each
+        // subtree spends only its own share, so the tree does not depend on the order in which jobs run.
+        static size_t share_budget(size_t budget, size_t n_left, size_t n_right) {
+            return static_cast<size_t>(static_cast<double>(budget) * n_left / (n_left + n_right));
+        }
+
+        static void make_leaf(const std::vector<bvh_prim_ref>& refs, uint32_t slot, std::vector<bvh_node>& nodes,
+                              std::vector<uint32_t>& indices) {
+            bvh_node& node = nodes[slot];
+            node.box = aabb();
+            node.left = indices.size();
+            node.right = 0;
+            node.count = refs.size();
+            node.axis = 0;
+            for (const auto& ref : refs) {
+                node.box.grow(ref.box);
+                indices.push_back(ref.index);
+            }
+        }
+
+        // Children are always appended after their parent, bvh::refit relies on this order
+        static uint32_t make_interior(uint32_t slot, uint32_t axis, std::vector<bvh_node>& nodes) {
+            const uint32_t l = nodes.size();
+            nodes.resize(nodes.size() + 2);
+            bvh_node& node = nodes[slot];
+            node.left = l;
+            node.right = l + 1;
+            node.count = 0;
+            node.axis = axis;
+            return l;
+        }
+
+        // Moves the subtree nodes behind the current nodes. The subtree root takes the place of its slot.
+        static void splice(const subtree& t, std::vector<bvh_node>& nodes, std::vector<uint32_t>& indices) {
+            const uint32_t base = nodes.size();
+            const uint32_t index_offset = indices.size();
+            auto relocate = [base, index_offset](bvh_node node) {
+                if (node.count > 0) {
+                    node.left += index_offset;
+                } else {
+                    node.left = base + node.left - 1;
+                    node.right = base + node.right - 1;
+                }
+                return node;
+            };
+            nodes[t.slot] = relocate(t.nodes[0]);
+            for (size_t k = 1; k < t.nodes.size(); ++k) nodes.push_back(relocate(t.nodes[k]));
+            indices.insert(indices.end(), t.indices.begin(), t.indices.end());
+        }
+
+        // Number of chunks a range of n references is split into for the thread pool
+        size_t num_chunks(size_t n, bool parallel) const {
+            if (!parallel) return 1;
+            return std::max<size_t>(1, std::min<size_t>(n / min_chunk_size, 4 * threadpool.num_threads()));
+        }
+
+        // Runs fn(chunk, begin, end) for every chunk of [0, n) and blocks until all chunks are done
+        void parallel_for(size_t n, size_t chunks, const std::function<void(size_t, size_t, size_t)>& fn) {
+            if (chunks == 1) {
+                fn(0, 0, n);
+                return;
+            }
+            for (size_t c = 0; c < chunks; ++c) {
+                const size_t begin = n * c / chunks;
+                const size_t end = n * (c + 1) / chunks;
+                std::function<void()> job = [&fn, c, begin, end] { fn(c, begin, end); };
+                threadpool.add_job(job);
+            }
+            threadpool.wait();
+        }
+
+        // Splits refs into left and right. Returns false if the node should become a leaf. References added by a
+        // spatial split are taken from budget.
+        bool split(const std::vector<bvh_prim_ref>& refs, std::vector<bvh_prim_ref>& left,
+                   std::vector<bvh_prim_ref>& right, uint32_t& axis, int depth, size_t& budget, bool parallel) {
+            const size_t n = refs.size();
+            if (n <= 1 || depth >= max_depth) return false;
+            if (mode == bvh_build_mode::lbvh) {
+                if (n <= lbvh_leaf_size) return false;
+                split_morton(refs, left, right, axis);
+                return true;
+            }
+            return split_sah(refs, left, right, axis, budget, parallel);
+        }
+
+        struct bin {
+            aabb box;
+            size_t count = 0;  // Object splits: primitives in the bin. Spatial splits: references entering the bin
+            size_t exits = 0;  // Spatial splits: references leaving the bin
+            // Spatial splits: change of the surface area that splitting adds to the references, at the bin's lower
+            // plane. Summed up over the bins it is the area added by a split at that plane.
+            double split_area = 0;
+        };
+
+        // Finds the cheapest split plane over binned costs. Returns the plane index and its SAH cost. A spatial
+        // split is also charged for the references it duplicates: the SAH of the children alone treats them as
+        // leaves, but the duplicates are carried on through the subtrees. Each ends up in some leaf, whose area
+        // is at least that of the clipped reference, and the two clipped halves of a reference have a larger
+        // surface than the whole. Planes below first_plane are skipped.
+        static void sweep_bins(const bin* bins, bool spatial, double parent_area, int& best_plane, double& best_cost,
+                               int first_plane = 1) {
+            double right_area[num_bins];
+            size_t right_count[num_bins];
+            aabb acc;
+            size_t count = 0;
+            for (int b = num_bins - 1; b > 0; --b) {
+                acc.grow(bins[b].box);
+                count += spatial ? bins[b].exits : bins[b].count;
+                right_area[b] = acc.surface_area();
+                right_count[b] = count;
+            }
+            acc = aabb();
+            count = 0;
+            double split_area = 0;
+            for (int b = 1; b < num_bins; ++b) {
+                acc.grow(bins[b - 1].box);
+                count += bins[b - 1].count;
+                split_area += spatial ? bins[b].split_area : 0.;
+                if (b < first_plane || count == 0 || right_count[b] == 0) continue;
+                const double cost = bvh_traversal_cost
+                    + bvh_intersection_cost * (acc.surface_area() * count + right_area[b] * right_count[b] + split_area) / parent_area;
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_plane = b;
+                }
+            }
+        }
+
+        bool split_sah(const std::vector<bvh_prim_ref>& refs, std::vector<bvh_prim_ref>& left,
+                       std::vector<bvh_prim_ref>& right, uint32_t& axis, size_t& budget, bool parallel) {
+            const size_t n = refs.size();
+            const size_t chunks = num_chunks(n, parallel);
+
+            // Node and centroid bounds
+            std::vector<aabb> chunk_bounds(chunks), chunk_centroids(chunks);
+            parallel_for(n, chunks, [&](size_t c, size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i) {
+                    chunk_bounds[c].grow(refs[i].box);
+                    chunk_centroids[c].grow(refs[i].box.centroid());
+                }
+            });
+            aabb bounds, centroids;
+            for (size_t c = 0; c < chunks; ++c) {
+                bounds.grow(chunk_bounds[c]);
+                centroids.grow(chunk_centroids[c]);
+            }
+            const double area = bounds.surface_area();
+
+            // Object split binning. SBVH adds a fourth row that bins the references by size.
+            const int rows = mode == bvh_build_mode::sbvh ? 4 : 3;
+            std::vector<bin> chunk_bins(chunks * rows * num_bins);
+            parallel_for(n, chunks, [&](size_t c, size_t begin, size_t end) {
+                bin* bins = &chunk_bins[c * rows * num_bins];
+                for (size_t i = begin; i < end; ++i) {
+                    const point3 p = refs[i].box.centroid();
+                    for (int a = 0; a < 3; ++a) {
+                        bin& b = bins[a * num_bins + object_bin(p[a], centroids, a)];
+                        b.box.grow(refs[i].box);
+                        ++b.count;
+                    }
+                    if (rows == 4) {
+                        bin& b = bins[3 * num_bins + size_bin(refs[i].box, area)];
+                        b.box.grow(refs[i].box);
+                        ++b.count;
+                    }
+                }
+            });
+            bin bins[4 * num_bins];
+            merge_bins(chunk_bins, chunks, bins, rows);
+
+            double best_cost = infinity;
+            int best_plane = -1;
+            int best_axis = -1;
+            for (int a = 0; a < 3; ++a) {
+                if (centroids.maximum[a] <= centroids.minimum[a]) continue;
+                int plane = -1;
+                double cost = best_cost;
+                sweep_bins(&bins[a * num_bins], false, area, plane, cost);
+                if (plane >= 0) {
+                    best_cost = cost;
+                    best_plane = plane;
+                    best_axis = a;
+                }
+            }
+
+            // A few large references among many small ones inflate the bounds of whichever child they fall into,
+            // however the centroids are split. Splitting them off by size keeps the other child tight. The large
+            // child only takes references close in size to the largest one, mixed with much smaller ones it would
+            // be as loose as this node.
+            int size_plane = -1;
+            if (rows == 4) {
+                int top = num_bins - 1;
+                while (top > 0 && bins[3 * num_bins + top].count == 0) --top;
+                const int first_plane = std::max(1, top + 1 - size_split_span);
+                sweep_bins(&bins[3 * num_bins], false, area, size_plane, best_cost, first_plane);
+            }
+            const int best_row = size_plane >= 0 ? 3 : best_axis;
+            if (size_plane >= 0) best_plane = size_plane;
+
+            // Try a spatial split if the children of the best object split overlap noticeably
+            bool spatial = false;
+            spatial_split_plane spatial_split;
+            if (mode == bvh_build_mode::sbvh && best_row >= 0 && budget > 0) {
+                aabb lbox, rbox;
+                for (int b = 0; b < num_bins; ++b) (b < best_plane ? lbox : rbox).grow(bins[best_row * num_bins + b].box);
+                if (intersect_box(lbox, rbox).surface_area() > spatial_split_alpha * root_area) {
+                    spatial = find_spatial_split(refs, bounds, area, chunks, best_cost, spatial_split);
+                }
+            }
+
+            const double leaf_cost = bvh_intersection_cost * n;
+            if (n <= max_leaf_size && leaf_cost <= best_cost) return false;
+
+            if (spatial && partition_spatial(refs, left, right, spatial_split, budget, chunks)) {
+                axis = spatial_split.axis;
+                return true;
+            }
+            if (size_plane >= 0) {
+                const vec3 extent = bounds.maximum - bounds.minimum;
+                axis = extent.x() >= extent.y() && extent.x() >= extent.z() ? 0 : (extent.y() >= extent.z() ? 1 : 2);
+                partition(refs, left, right, chunks, [&](const bvh_prim_ref& ref) {
+                    return size_bin(ref.box, area) < size_plane;
+                });
+                return true;
+            }
+
+            if (best_axis < 0) {
+                // All centroids coincide, split in the middle of the list
+                axis = 0;
+                left.assign(refs.begin(), refs.begin() + n / 2);
+                right.assign(refs.begin() + n / 2, refs.end());
+                return true;
+            }
+            axis = best_axis;
+            const int plane = best_plane;
+            const int a = best_axis;
+            partition(refs, left, right, chunks, [&](const bvh_prim_ref& ref) {
+                return object_bin(ref.box.centroid()[a], centroids, a) < plane;
+            });
+            return true;
+        }
+
+        static int object_bin(double x, const aabb& centroids, int a) {
+            const double extent = centroids.maximum[a] - centroids.minimum[a];
+            if (extent <= 0) return 0;
+            const int b = static_cast<int>(num_bins * (x - centroids.minimum[a]) / extent);
+            return std::min(std::max(b, 0), num_bins - 1);
+        }
+
+        // Size bin of a reference: the log2 ratio of its surface area to the node's, the largest in the last bin
+        static int size_bin(const aabb& box, double node_area) {
+            const double ratio = box.surface_area() / node_area;
+            if (!(ratio > 0)) return 0;
+            const int b = num_bins - 1 + static_cast<int>(std::floor(std::log2(ratio)));
+            return std::min(std::max(b, 0), num_bins - 1);
+        }
+
+        // Sums the per-chunk bins, each chunk holding rows rows of num_bins bins
+        static void merge_bins(const std::vector<bin>& chunk_bins, size_t chunks, bin* bins, int rows = 3) {
+            for (size_t c = 0; c < chunks; ++c) {
+                for (int k = 0; k < rows * num_bins; ++k) {
+                    const bin& src = chunk_bins[c * rows * num_bins + k];
+                    bins[k].box.grow(src.box);
+                    bins[k].count += src.count;
+                    bins[k].exits += src.exits;
+                    bins[k].split_area += src.split_area;
+                }
+            }
+        }
+
+        // Plane of a spatial split with the bounds and reference counts of the clipped children
+        struct spatial_split_plane {
+            int axis = -1;
+            double position = 0;
+            aabb left_box, right_box;
+            size_t left_count = 0, right_count = 0;
+        };
+
+        // Bins the references clipped against equally sized slabs of the node bounds. Returns true if a spatial
+        // split beats best_cost, which is then updated together with the split.
+        bool find_spatial_split(const std::vector<bvh_prim_ref>& refs, const aabb& bounds, double area, size_t chunks,
+                                double& best_cost, spatial_split_plane& split) {
+            const size_t n = refs.size();
+            std::vector<bin> chunk_bins(chunks * 3 * num_bins);
+            parallel_for(n, chunks, [&](size_t c, size_t begin, size_t end) {
+                bin* bins = &chunk_bins[c * 3 * num_bins];
+                for (size_t i = begin; i < end; ++i) {
+                    const aabb& box = refs[i].box;
+                    for (int a = 0; a < 3; ++a) {
+                        const int first = spatial_bin(box.minimum[a], bounds, a);
+                        const int last = spatial_bin(box.maximum[a], bounds, a);
+                        for (int b = first; b <= last; ++b) {
+                            aabb slab = bounds;
+                            slab.minimum[a] = bin_position(b, bounds, a);
+                            slab.maximum[a] = bin_position(b + 1, bounds, a);
+                            bins[a * num_bins + b].box.grow(clip(refs[i], intersect_box(box, slab)));
+                        }
+                        ++bins[a * num_bins + first].count;
+                        ++bins[a * num_bins + last].exits;
+                        if (first < last) {
+                            // Splitting the reference at any plane in between adds two cross sections
+                            const vec3 d = box.maximum - box.minimum;
+                            const double cross = 2. * d[(a + 1) % 3] * d[(a + 2) % 3];
+                            bins[a * num_bins + first + 1].split_area += cross;
+                            if (last + 1 < num_bins) bins[a * num_bins + last + 1].split_area -= cross;
+                        }
+                    }
+                }
+            });
+            bin bins[3 * num_bins];
+            merge_bins(chunk_bins, chunks, bins);
+
+            bool found = false;
+            for (int a = 0; a < 3; ++a) {
+                if (bounds.maximum[a] <= bounds.minimum[a]) continue;
+                int plane = -1;
+                double cost = best_cost;
+                sweep_bins(&bins[a * num_bins], true, area, plane, cost);
+                if (plane >= 0) {
+                    best_cost = cost;
+                    split = spatial_split_plane();
+                    split.axis = a;
+                    split.position = bin_position(plane, bounds, a);
+                    for (int b = 0; b < num_bins; ++b) {
+                        const bin& bn = bins[a * num_bins + b];
+                        if (b < plane) {
+                            split.left_box.grow(bn.box);
+                            split.left_count += bn.count;
+                        } else {
+                            split.right_box.grow(bn.box);
+                            split.right_count += bn.exits;
+                        }
+                    }
+                    found = true;
+                }
+            }
+            return found;
+        }
+
+        static int spatial_bin(double x, const aabb& bounds, int a) {
+            const double extent = bounds.maximum[a] - bounds.minimum[a];
+            if (extent <= 0) return 0;
+            const int b = static_cast<int>(num_bins * (x - bounds.minimum[a]) / extent);
+            return std::min(std::max(b, 0), num_bins - 1);
+        }
+
+        static double bin_position(int b, const aabb& bounds, int a) {
+            if (b >= num_bins) return bounds.maximum[a];
+            return bounds.minimum[a] + (bounds.maximum[a] - bounds.minimum[a]) * b / num_bins;
+        }
+
+        // Parallel stable partition: count per chunk, prefix sum, then scatter each chunk to its offset
+        template <typename Pred>
+        void partition(const std::vector<bvh_prim_ref>& refs, std::vector<bvh_prim_ref>& left,
+                       std::vector<bvh_prim_ref>& right, size_t chunks, Pred pred) {
+            const size_t n = refs.size();
+            std::vector<size_t> left_counts(chunks, 0);
+            parallel_for(n, chunks, [&](size_t c, size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i) left_counts[c] += pred(refs[i]);
+            });
+            std::vector<size_t> left_offsets(chunks), right_offsets(chunks);
+            size_t n_left = 0, n_right = 0;
+            for (size_t c = 0; c < chunks; ++c) {
+                left_offsets[c] = n_left;
+                right_offsets[c] = n_right;
+                n_left += left_counts[c];
+                n_right += n * (c + 1) / chunks - n * c / chunks - left_counts[c];
+            }
+            left.resize(n_left);
+            right.resize(n_right);
+            parallel_for(n, chunks, [&](size_t c, size_t begin, size_t end) {
+                size_t l = left_offsets[c], r = right_offsets[c];
+                for (size_t i = begin; i < end; ++i) {
+                    if (pred(refs[i])) left[l++] = refs[i];
+                    else right[r++] = refs[i];
+                }
+            });
+        }
+
+        // none: the primitive has no surface within the node, the reference is dropped
+        enum class split_side { left, right, both, none };
+
+        // Bounds of the part of a reference's primitive inside box
+        aabb clip(const bvh_prim_ref& ref, const aabb& box) const {
+            return prims[ref.index]->clip_box(box);
+        }
+
+        // Side of a spatial split a reference goes to, with the clipped bounds of the parts on either side. A
+        // straddling reference is only split if that is cheaper than adding all of it to one child (reference
+        // unsplitting, Stich et al. 2009): duplicating it costs a reference in each child, keeping it whole grows
+        // one child's bounds.
+        split_side spatial_side(const bvh_prim_ref& ref, const spatial_split_plane& split, aabb& left_box, aabb& right_box) const {
+            const int a = split.axis;
+            if (ref.box.maximum[a] <= split.position) return split_side::left;
+            if (ref.box.minimum[a] >= split.position) return split_side::right;
+            left_box = ref.box;
+            left_box.maximum[a] = split.position;
+            left_box = clip(ref, left_box);
+            right_box = ref.box;
+            right_box.minimum[a] = split.position;
+            right_box = clip(ref, right_box);
+            // The primitive may not reach into one side of the plane within its clipped bounds
+            if (left_box.empty() && right_box.empty()) return split_side::none;
+            if (right_box.empty()) return split_side::left;
+            if (left_box.empty()) return split_side::right;
+            const double left_area = split.left_box.surface_area();
+            const double right_area = split.right_box.surface_area();
+            const double cost_split = left_area * split.left_count + right_area * split.right_count;
+            const double cost_left = surrounding_box(split.left_box, ref.box).surface_area() * split.left_count
+                                   + right_area * (split.right_count - 1);
+            const double cost_right = left_area * (split.left_count - 1)
+                                    + surrounding_box(split.right_box, ref.box).surface_area() * split.right_count;
+            if (cost_split <= cost_left && cost_split <= cost_right) return split_side::both;
+            return cost_left <= cost_right ? split_side::left : split_side::right;
+        }
+
+        // Distributes the references to both sides of the plane, straddling references are split in two or kept
+        // whole on one side, see spatial_side. Returns false if the split would not separate anything or exceeds
+        // the reference budget of the node, which is charged for the added references otherwise.
+        bool partition_spatial(const std::vector<bvh_prim_ref>& refs, std::vector<bvh_prim_ref>& left,
+                               std::vector<bvh_prim_ref>& right, const spatial_split_plane& split, size_t& budget,
+                               size_t chunks) {
+            const size_t n = refs.size();
+            std::vector<size_t> left_counts(chunks, 0), right_counts(chunks, 0);
+            parallel_for(n, chunks, [&](size_t c, size_t begin, size_t end) {
+                aabb left_box, right_box;
+                for (size_t i = begin; i < end; ++i) {
+                    const split_side side = spatial_side(refs[i], split, left_box, right_box);
+                    left_counts[c] += side == split_side::left || side == split_side::both;
+                    right_counts[c] += side == split_side::right || side == split_side::both;
+                }
+            });
+            std::vector<size_t> left_offsets(chunks), right_offsets(chunks);
+            size_t n_left = 0, n_right = 0;
+            for (size_t c = 0; c < chunks; ++c) {
+                left_offsets[c] = n_left;
+                right_offsets[c] = n_right;
+                n_left += left_counts[c];
+                n_right += right_counts[c];
+            }
+            if (n_left == 0 || n_right == 0 || n_left == n || n_right == n) return false;
+            const size_t added = n_left + n_right > n ? n_left + n_right - n : 0;
+            if (added > budget) return false;
+            budget -= added;
+
+            left.resize(n_left);
+            right.resize(n_right);
+            parallel_for(n, chunks, [&](size_t c, size_t begin, size_t end) {
+                size_t l = left_offsets[c], r = right_offsets[c];
+                aabb left_box, right_box;
+                for (size_t i = begin; i < end; ++i) {
+                    const bvh_prim_ref& ref = refs[i];
+                    const split_side side = spatial_side(ref, split, left_box, right_box);
+                    if (side == split_side::left) {
+                        left[l++] = ref;
+                    } else if (side == split_side::right) {
+                        right[r++] = ref;
+                    } else if (side == split_side::both) {
+                        left[l] = ref;
+                        left[l++].box = left_box;
+                        right[r] = ref;
+                        right[r++].box = right_box;
+                    }
+                }
+            });
+            return true;
+        }
+
+        // Spreads the lower 10 bits of x so that two zero bits follow each bit
+        static uint32_t expand_bits(uint32_t x) {
+            x = (x * 0x00010001u) & 0xFF0000FFu;
+            x = (x * 0x00000101u) & 0x0F00F00Fu;
+            x = (x * 0x00000011u) & 0xC30C30C3u;
+            x = (x * 0x00000005u) & 0x49249249u;
+            return x;
+        }
+
+        // Computes the 30 bit Morton codes of the centroids and sorts the references by them. Chunks are sorted
+        // in parallel and then merged pairwise, again in parallel.
+        void sort_morton(std::vector<bvh_prim_ref>& refs) {
+            const size_t n = refs.size();
+            const size_t chunks = num_chunks(n, true);
+            std::vector<aabb> chunk_centroids(chunks);
+            parallel_for(n, chunks, [&](size_t c, size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i) chunk_centroids[c].grow(refs[i].box.centroid());
+            });
+            aabb centroids;
+            for (const auto& box : chunk_centroids) centroids.grow(box);
+            const vec3 extent = centroids.maximum - centroids.minimum;
+
+            parallel_for(n, chunks, [&](size_t c, size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i) {
+                    const point3 p = refs[i].box.centroid();
+                    uint32_t q[3];
+                    for (int a = 0; a < 3; ++a) {
+                        const double t = extent[a] > 0 ? (p[a] - centroids.minimum[a]) / extent[a] : 0.;
+                        q[a] = static_cast<uint32_t>(std::min(std::max(t * 1024., 0.), 1023.));
+                    }
+                    refs[i].code = (expand_bits(q[0]) << 2) | (expand_bits(q[1]) << 1) | expand_bits(q[2]);
+                }
+            });
+
+            auto by_code = [](const bvh_prim_ref& a, const bvh_prim_ref& b) { return a.code < b.code; };
+            parallel_for(n, chunks, [&](size_t, size_t begin, size_t end) {
+                std::sort(refs.begin() + begin, refs.begin() + end, by_code);
+            });
+            for (size_t width = 1; width < chunks; width *= 2) {
+                const size_t merges = (chunks + 2 * width - 1) / (2 * width);
+                parallel_for(merges, merges, [&](size_t m, size_t, size_t) {
+                    const size_t first = n * std::min(chunks, 2 * m * width) / chunks;
+                    const size_t middle = n * std::min(chunks, (2 * m + 1) * width) / chunks;
+                    const size_t last = n * std::min(chunks, (2 * m + 2) * width) / chunks;
+                    std::inplace_merge(refs.begin() + first, refs.begin() + middle, refs.begin() + last, by_code);
+                });
+            }
+        }
+
+        // Splits a Morton-sorted range at the highest bit in which its first and last code differ
+        static void split_morton(const std::vector<bvh_prim_ref>& refs, std::vector<bvh_prim_ref>& left,
+                                 std::vector<bvh_prim_ref>& right, uint32_t& axis) {
+            const size_t n = refs.size();
+            const uint32_t first = refs.front().code;
+            const uint32_t last = refs.back().code;
+            size_t mid = n / 2;
+            axis = 0;
+            if (first != last) {
+                const int bit = 31 - __builtin_clz(first ^ last);
+                const uint32_t mask = 1u << bit;
+                // First reference with the bit set
+                mid = std::partition_point(refs.begin(), refs.end(), [mask](const bvh_prim_ref& ref) {
+                    return (ref.code & mask) == 0;
+                }) - refs.begin();
+                // x, y and z occupy bits 3k+2, 3k+1 and 3k
+                axis = 2 - bit % 3;
+            }
+            left.assign(refs.begin(), refs.begin() + mid);
+            right.assign(refs.begin() + mid, refs.end());
+        }
+
+    private:
+        // Minimum overlap of the object split children, relative to the root area, to try a spatial split
+        static constexpr double spatial_split_alpha = 1e-5;
+
+        bvh_build_mode mode;
+        ThreadPool& threadpool;
+        const std::vector<shared_ptr<hittable>>& prims;
+        size_t subtree_size;
+        size_t max_extra_refs;
+        double root_area = 0;
+};
+
+// Node array and leaf primitive list of a BVH, replicated per NUMA node on request
+struct bvh_tree {
+    std::vector<bvh_node> nodes;
+    std::vector<const hittable*> primitives;
+    std::vector<shared_ptr<hittable>> copies;  // Node-local copies of the primitives, empty for the original
+};
+
+class bvh : public hittable {
+
+    public:
+        bvh(const hittable_list& list, bvh_build_mode mode, ThreadPool& threadpool) : objects(list.objects), trees(1) {
+            auto begin = std::chrono::steady_clock::now();
+
+            std::vector<bvh_prim_ref> refs(objects.size());
+            for (size_t i = 0; i < objects.size(); ++i) {
+                if (!objects[i]->bounding_box(refs[i].box))
+                    std::cerr << "BVH: Object " << i << " has no bounding box" << std::endl;
+                refs[i].index = i;
+                refs[i].code = 0;
+            }
+            bvh_tree& tree = trees[0];
+            bvh_builder builder(mode, threadpool, objects);
+            builder.build(refs, tree.nodes, indices);
+            refit(tree.nodes);
+            tree.primitives.resize(indices.size());
+            for (size_t i = 0; i < indices.size(); ++i) tree.primitives[i] = objects[indices[i]].get();
+
+            auto end = std::chrono::steady_clock::now();
+            build_stats.build_ms = std::chrono::duration<double, std::milli>(end - begin).count();
+            compute_stats();
+        }
+
+        bool hit(const ray& r, const double t_min, const double t_max, hit_record& rec) const override;
+
+        bool bounding_box(aabb& output_box) const override {
+            if (trees[0].nodes.empty()) return false;
+            output_box = trees[0].nodes[0].box;
+            return true;
+        }
+
+        const bvh_build_stats& stats() const { return build_stats; }
+
+        // Gives every NUMA node of the pool its own copy of the tree and the primitives. Each copy is made by
+        // a worker on that node so its pages are allocated there. Rays use the copy of the node they run on.
+        void replicate(ThreadPool& threadpool) {
+            const uint32_t n_nodes = threadpool.num_nodes();
+            if (n_nodes < 2) return;
+            std::vector<bvh_tree> replicas(n_nodes);
+            std::vector<int> copier(n_nodes, -1);
+            for (uint32_t w = 0; w < threadpool.num_threads(); ++w) {
+                if (copier[threadpool.worker_node(w)] < 0) copier[threadpool.worker_node(w)] = w;
+            }
+            threadpool.run_on_workers([&](uint32_t worker) {
+                const uint32_t node = threadpool.worker_node(worker);
+                if (copier[node] != static_cast<int>(worker)) return;
+                bvh_tree& replica = replicas[node];
+                replica.nodes = trees[0].nodes;
+                replica.copies.resize(objects.size());
+                replica.primitives.resize(indices.size());
+                for (size_t i = 0; i < indices.size(); ++i) {
+                    auto& copy = replica.copies[indices[i]];
+                    if (!copy) copy = objects[indices[i]]->clone();
+                    if (!copy) copy = objects[indices[i]];
+                    replica.primitives[i] = copy.get();
+                }
+            });
+            // Nodes without a worker never look up their tree, keep the original for them
+            for (uint32_t node = 0; node < n_nodes; ++node) {
+                if (copier[node] < 0) replicas[node] = trees[0];
+            }
+            trees.swap(replicas);
+        }
+
+    private:
+        // Children are stored after their parents, so a reverse sweep computes all interior bounds bottom-up
+        static void refit(std::vector<bvh_node>& nodes) {
+            for (size_t i = nodes.size(); i-- > 0;) {
+                bvh_node& node = nodes[i];
+                if (node.count == 0) node.box = surrounding_box(nodes[node.left].box, nodes[node.right].box);
+            }
+        }
+
+        // Expected cost of a random ray hitting the root
+        static double sah_cost(const std::vector<bvh_node>& nodes) {
+            if (nodes.empty()) return 0;
+            double cost = 0;
+            for (const auto& node : nodes) {
+                if (node.count > 0) cost += bvh_intersection_cost * node.count * node.box.surface_area();
+                else cost += bvh_traversal_cost * node.box.surface_area();
+            }
+            return cost / nodes[0].box.surface_area();
+        }
+
+        void compute_stats() {
+            const auto& nodes = trees[0].nodes;
+            build_stats.nodes = nodes.size();
+            build_stats.references = indices.size();
+            build_stats.leaves = 0;
+            for (const auto& node : nodes) build_stats.leaves += node.count > 0;
+            build_stats.sah_cost = sah_cost(nodes);
+        }
+
+    public:
+        std::vector<shared_ptr<hittable>> objects;
+
+    private:
+        std::vector<bvh_tree> trees;
+        std::vector<uint32_t> indices;  // Object index of every leaf primitive
+        bvh_build_stats build_stats;
+};
+
+bool bvh::hit(const ray& r, const double t_min, const double t_max, hit_record& rec) const {
+    const bvh_tree& tree = trees[trees.size() > 1 ? std::min<size_t>(ThreadPool::current_node(), trees.size() - 1) : 0];
+    const auto& nodes = tree.nodes;
+    const auto& primitives = tree.primitives;
+    if (nodes.empty()) return false;
+
+    const point3 origin = r.origin();
+    const vec3 dir = r.direction();
+    const vec3 inv_dir(1. / dir.x(), 1. / dir.y(), 1. / dir.z());
+    uint32_t stack[64];
+    int stack_size = 0;
+    uint32_t current = 0;
+    hit_record temp_rec;
+    bool hit_anything = false;
+    auto closest_so_far = t_max;
+
+    while (true) {
+        const bvh_node& node = nodes[current];
+        if (node.box.hit(origin, inv_dir, t_min, closest_so_far)) {
+            if (node.count > 0) {
+                for (uint32_t k = 0; k < node.count; ++k) {
+                    if (primitives[node.left + k]->hit(r, t_min, closest_so_far, temp_rec)) {
+                        hit_anything = true;
+                        closest_so_far = temp_rec.t;
+                        rec = temp_rec;
+                    }
+                }
+            } else {
+                // Visit the child on the near side of the split first
+                const bool near_right = dir[node.axis] < 0;
+                stack[stack_size++] = near_right ? node.left : node.right;
+                current = near_right ? node.right : node.left;
+                continue;
+            }
+        }
+        if (stack_size == 0) break;
+        current = stack[--stack_size];
+    }
+    return hit_anything;
+}
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "vec3.h"
+#include "framebuffer.h"
+#include "denoise.h"
+
+// Render settings a checkpoint must agree with to be resumed
+struct checkpoint_header {
+    uint64_t seed;
+    uint64_t scene_hash;  // checkpoint_scene_hash of the settings that shape the rendered image
+    int32_t width;
+    int32_t height;
+    uint8_t deterministic;
+    uint8_t has_aovs;
+    uint8_t spectral;     // 0 RGB, 1 hero wavelengths, 2 single wavelength
+    uint8_t reserved[5];  // Explicit padding, keeps the header free of uninitialized bytes
+};
+
+static const char checkpoint_magic[8] = {'R', 'T', 'C', 'K', 'P', 'T', '0', '3'};
+
+// FNV-1a hash of a description of the scene, its lighting and the path depth. Resuming with any of them changed
+// would average two different images.
+inline uint64_t checkpoint_scene_hash(const std::string& settings) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : settings) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+template <typename T, typename Alloc>
+inline void write_buffer(std::ofstream& out, const std::vector<T, Alloc>& buffer) {
+    out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size() * sizeof(T));
+}
+
+template <typename T, typename Alloc>
+inline void read_buffer(std::ifstream& in, std::vector<T, Alloc>& buffer) {
+    in.read(reinterpret_cast<char*>(buffer.data()), buffer.size() * sizeof(T));
+}
+
+// Save the accumulated colors and per-pixel sample counts. The file is written next to path first and then
+// renamed, so a job killed while saving never leaves a truncated checkpoint behind.
+bool save_checkpoint(const std::string& path, const checkpoint_header& header, const pixel_buffer<color>& pixel_colors,
+                     const pixel_buffer<uint32_t>& sample_counts, const aov_buffers& aovs) {
+    const std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            std::cerr << "Checkpoint: Cannot open " << tmp_path << " for writing" << std::endl;
+            return false;
+        }
+        out.write(checkpoint_magic, sizeof(checkpoint_magic));
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        write_buffer(out, sample_counts);
+        write_buffer(out, pixel_colors);
+        if (header.has_aovs) {
+            write_buffer(out, aovs.albedo);
+            write_buffer(out, aovs.normal);
+            write_buffer(out, aovs.depth);
+        }
+        if (!out) {
+            std::cerr << "Checkpoint: Failed to write " << tmp_path << std::endl;
+            return false;
+        }
+    }
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::cerr << "Checkpoint: Failed to rename " << tmp_path << " to " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Load a checkpoint written by save_checkpoint. The buffers must already be sized for the image. Fails if the
+// checkpoint was rendered with different settings than expected.
+bool load_checkpoint(const std::string& path, const checkpoint_header& expected, pixel_buffer<color>& pixel_colors,
+                     pixel_buffer<uint32_t>& sample_counts, aov_buffers& aovs) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        std::cerr << "Checkpoint: Cannot open " << path << std::endl;
+        return false;
+    }
+    char magic[sizeof(checkpoint_magic)];
+    checkpoint_header header = {};
+    in.read(magic, sizeof(magic));
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!in || memcmp(magic, checkpoint_magic, sizeof(magic)) != 0) {
+        std::cerr << "Checkpoint: " << path << " is not a checkpoint file" << std::endl;
+        return false;
+    }
+    if (header.width != expected.width || header.height != expected.height) {
+        std::cerr << "Checkpoint: Image size " << header.width << "x" << header.height << " does not match" << std::endl;
+        return false;
+    }
+    if (header.deterministic != expected.deterministic || (expected.deterministic && header.seed != expected.seed)) {
+        std::cerr << "Checkpoint: Deterministic mode or seed does not match" << std::endl;
+        return false;
+    }
+    if (header.scene_hash != expected.scene_hash) {
+        std::cerr << "Checkpoint: Scene, environment map or max depth does not match" << std::endl;
+        return false;
+    }
+    if (header.spectral != expected.spectral) {
+        std::cerr << "Checkpoint: Spectral mode does not match" << std::endl;
+        return false;
+    }
+    if (expected.has_aovs && !header.has_aovs) {
+        std::cerr << "Checkpoint: No AOVs stored, cannot resume a denoised render" << std::endl;
+        return false;
+    }
+    read_buffer(in, sample_counts);
+    read_buffer(in, pixel_colors);
+    if (header.has_aovs) {
+        if (expected.has_aovs) {
+            read_buffer(in, aovs.albedo);
+            read_buffer(in, aovs.normal);
+            read_buffer(in, aovs.depth);
+        } else {
+            // Skip the AOVs of a checkpoint that was rendered with denoising
+            in.seekg(pixel_colors.size() * (sizeof(color) + sizeof(vec3) + sizeof(double)), std::ios::cur);
+        }
+    }
+    if (!in) {
+        std::cerr << "Checkpoint: " << path << " is truncated" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,240 @@
+#ifndef DENOISE_H_
+#define DENOISE_H_
+
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+
+#include "vec3.h"
+#include "framebuffer.h"
+#include "threading/threadpool.h"
+
+// Depth written to the AOV when a primary ray escapes to the background
+const double aov_miss_depth = 1e6;
+// Lower bound of the albedo used to demodulate the color, keeps black surfaces from blowing up
+const double albedo_eps = 1e-3;
+
+// First-hit information of a single camera sample
+struct aov_sample {
+    color albedo;
+    vec3 normal;
+    double depth;
+};
+
+// Auxiliary buffers for the denoiser. Like the color buffer, each pixel holds the sum over all its samples.
+struct aov_buffers {
+    pixel_buffer<color> albedo;
+    pixel_buffer<vec3> normal;
+    pixel_buffer<double> depth;
+
+    // Allocates the buffers without initializing them, see clear()
+    void resize(size_t n) {
+        albedo.resize(n);
+        normal.resize(n);
+        depth.resize(n);
+    }
+
+    void clear(size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            albedo[i] = color(0, 0, 0);
+            normal[i] = vec3(0, 0, 0);
+            depth[i] = 0.;
+        }
+    }
+
+    void add(size_t idx, const aov_sample& s) {
+        albedo[idx] += s.albedo;
+        normal[idx] += s.normal;
+        depth[idx] += s.depth;
+    }
+};
+
+struct denoise_settings {
+    int iterations = 5;
+    int tile_size = 32;
+    double sigma_color = 0.6;
+    double sigma_normal = 0.3;
+    double sigma_albedo = 0.1;
+    double sigma_depth = 0.05;
+};
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) guided by the albedo, normal and depth AOVs.
+// The color is demodulated by the albedo before filtering so that texture detail is not blurred away.
+// The buffers are stored as separate planes and the per-tap row loop is branch-free, so the compiler vectorizes
+// it over contiguous memory (check with -fopt-info-vec). Each iteration is split into tiles which are processed
+// by the thread pool.
+class atrous_denoiser {
+
+    public:
+        atrous_denoiser(int width, int height, const denoise_settings& settings)
+            : img_width(width), img_height(height), s(settings) {
+            const size_t n = static_cast<size_t>(width) * height;
+            for (auto plane : {&r, &g, &b, &tr, &tg, &tb, &nx, &ny, &nz, &ar, &ag, &ab, &z, &inv_depth}) {
+                plane->resize(n);
+            }
+        }
+
+        // Filter the accumulated colors in place. Colors and AOVs are sums over samples_per_pixel samples. In NUMA
+        // mode every worker loads, and so first-touches, the planes of the scanlines it owns, and the tiles are
+        // block-high strips queued to the owner of their rows.
+        void run(pixel_buffer<color>& pixel_colors, const uint32_t samples_per_pixel, const aov_buffers& aovs, ThreadPool& threadpool,
+                 bool numa = false) {
+            const uint32_t n_workers = threadpool.num_threads();
+            if (numa) {
+                threadpool.run_on_workers([&](uint32_t worker) {
+                    for (int j = 0; j < img_height; ++j)
+                        if (row_owner(j, n_workers) == worker) load_row(j, pixel_colors, samples_per_pixel, aovs);
+                });
+            } else {
+                for (int j = 0; j < img_height; ++j) load_row(j, pixel_colors, samples_per_pixel, aovs);
+            }
+            // Once the tap spacing exceeds the image every neighbour is clamped away, further passes change nothing
+            int iterations = 0;
+            while (iterations < s.iterations && (1 << iterations) < std::max(img_width, img_height)) ++iterations;
+            for (int it = 0; it < iterations; ++it) {
+                const int step = 1 << it;
+                // Halve the color tolerance every iteration, the noise drops with each pass
+                const double sigma_c = std::ldexp(s.sigma_color, -it);
+                // NUMA strips cover as many pixels as a square tile
+                const int tile_h = numa ? rows_per_block : s.tile_size;
+                const int tile_w = numa ? s.tile_size * s.tile_size / rows_per_block : s.tile_size;
+                for (int y0 = 0; y0 < img_height; y0 += tile_h) {
+                    for (int x0 = 0; x0 < img_width; x0 += tile_w) {
+                        std::function<void()> fun = [this, x0, y0, tile_w, tile_h, step, sigma_c] {
+                            filter_tile(x0, y0, std::min(x0 + tile_w, img_width), std::min(y0 + tile_h, img_height), step, sigma_c);
+                        };
+                        if (numa) threadpool.add_job(fun, row_owner(y0, n_workers));
+                        else threadpool.add_job(fun);
+                    }
+                }
+                threadpool.wait();
+                std::swap(r, tr);
+                std::swap(g, tg);
+                std::swap(b, tb);
+            }
+            store(pixel_colors, samples_per_pixel);
+        }
+
+    private:
+        void load_row(int j, const pixel_buffer<color>& pixel_colors, const uint32_t samples_per_pixel, const aov_buffers& aovs) {
+            const double scale = 1. / samples_per_pixel;
+            const size_t first = static_cast<size_t>(j) * img_width, last = first + img_width;
+            for (size_t i = first; i != last; ++i) {
+                const color a = aovs.albedo[i] * scale;
+                ar[i] = a.x();
+                ag[i] = a.y();
+                ab[i] = a.z();
+                const vec3 n = aovs.normal[i] * scale;
+                nx[i] = n.x();
+                ny[i] = n.y();
+                nz[i] = n.z();
+                z[i] = aovs.depth[i] * scale;
+                inv_depth[i] = 1. / std::max(z[i], 1e-3);
+                r[i] = pixel_colors[i].x() * scale / std::max(ar[i], albedo_eps);
+                g[i] = pixel_colors[i].y() * scale / std::max(ag[i], albedo_eps);
+                b[i] = pixel_colors[i].z() * scale / std::max(ab[i], albedo_eps);
+                tr[i] = tg[i] = tb[i] = 0.;
+            }
+        }
+
+        void store(pixel_buffer<color>& pixel_colors, const uint32_t samples_per_pixel) const {
+            for (size_t i = 0; i != r.size(); ++i) {
+                pixel_colors[i] = samples_per_pixel * color(r[i] * std::max(ar[i], albedo_eps),
+                                                            g[i] * std::max(ag[i], albedo_eps),
+                                                            b[i] * std::max(ab[i], albedo_eps));
+            }
+        }
+
+        // Edge-stopping weight exp(-e), computed as the limit (1 - e/256)^256. Within a few percent of exp(-e) where
+        // the weights matter and, unlike std::exp, branch-free arithmetic the compiler can vectorize.
+        static double edge_weight(double e) {
+            // max(1 - e/256, 0) written with fabs, a compare would keep the loop from being if-converted
+            const double t = 1. - e * (1. / 256);
+            double w = 0.5 * (t + std::fabs(t));
+            w *= w; w *= w; w *= w; w *= w;
+            w *= w; w *= w; w *= w; w *= w;
+            return w;
+        }
+
+        void filter_tile(int x0, int y0, int x1, int y1, int step, double sigma_c) {
+            static const double kernel[5] = {1. / 16, 1. / 4, 3. / 8, 1. / 4, 1. / 16};
+            const double inv_c = 1. / (sigma_c * sigma_c);
+            const double inv_n = 1. / (s.sigma_normal * s.sigma_normal);
+            const double inv_a = 1. / (s.sigma_albedo * s.sigma_albedo);
+            const double inv_z = 1. / (s.sigma_depth * step);
+            const int w = x1 - x0;
+            thread_local std::vector<double> acc_buffer;
+            acc_buffer.assign(4 * w, 0.);
+            double* acc_r = acc_buffer.data();
+            double* acc_g = acc_r + w;
+            double* acc_b = acc_g + w;
+            double* acc_w = acc_b + w;
+
+            for (int y = y0; y < y1; ++y) {
+                std::fill(acc_r, acc_r + 4 * w, 0.);
+                const size_t p_row = static_cast<size_t>(y) * img_width;
+                // Taps outside the image are skipped by clamping the row range and the x range of each tap, which
+                // keeps the innermost loop free of branches
+                const int ky0 = std::max(0, 2 - y / step);
+                const int ky1 = std::min(5, 2 + (img_height - 1 - y) / step + 1);
+
+                for (int ky = ky0; ky < ky1; ++ky) {
+                    const size_t q_row = static_cast<size_t>(y + (ky - 2) * step) * img_width;
+
+                    for (int kx = 0; kx < 5; ++kx) {
+                        const int dx = (kx - 2) * step;
+                        const double h = kernel[ky] * kernel[kx];
+                        const int xs = std::max(x0, -dx);
+                        const int xe = std::min(x1, img_width - dx);
+                        // The accumulators never alias the planes, without ivdep the 4 x 14 runtime alias checks
+                        // exceed what GCC is willing to version the loop for
+                        #pragma GCC ivdep
+                        for (int x = xs; x < xe; ++x) {
+                            const size_t p = p_row + x;
+                            const size_t q = q_row + x + dx;
+                            const double dr = r[p] - r[q], dg = g[p] - g[q], db = b[p] - b[q];
+                            const double dnx = nx[p] - nx[q], dny = ny[p] - ny[q], dnz = nz[p] - nz[q];
+                            const double dar = ar[p] - ar[q], dag = ag[p] - ag[q], dab = ab[p] - ab[q];
+                            const double dz = std::fabs(z[p] - z[q]) * inv_depth[p];
+                            const double e = (dr * dr + dg * dg + db * db) * inv_c
+                                           + (dnx * dnx + dny * dny + dnz * dnz) * inv_n
+                                           + (dar * dar + dag * dag + dab * dab) * inv_a
+                                           + dz * inv_z;
+                            const double wq = h * edge_weight(e);
+                            const int i = x - x0;
+                            acc_r[i] += wq * r[q];
+                            acc_g[i] += wq * g[q];
+                            acc_b[i] += wq * b[q];
+                            acc_w[i] += wq;
+                        }
+                    }
+                }
+
+                // The center tap always contributes, so the weight sum is never zero
+                double* out_r = &tr[p_row + x0];
+                double* out_g = &tg[p_row + x0];
+                double* out_b = &tb[p_row + x0];
+                #pragma GCC ivdep
+                for (int i = 0; i < w; ++i) {
+                    out_r[i] = acc_r[i] / acc_w[i];
+                    out_g[i] = acc_g[i] / acc_w[i];
+                    out_b[i] = acc_b[i] / acc_w[i];
+                }
+            }
+        }
+
+    private:
+        int img_width;
+        int img_height;
+        denoise_settings s;
+        // Demodulated color, filter target, normal, albedo, depth and reciprocal depth planes. Allocated
+        // uninitialized, load_row() writes them first.
+        pixel_buffer<double> r, g, b;
+        pixel_buffer<double> tr, tg, tb;
+        pixel_buffer<double> nx, ny, nz;
+        pixel_buffer<double> ar, ag, ab;
+        pixel_buffer<double> z, inv_depth;
+};
+
+#endif
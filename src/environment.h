@@ -0,0 +1,159 @@
+#ifndef ENVIRONMENT_H_
+#define ENVIRONMENT_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "utils.h"
+#include "vec3.h"
+
+// Multiple importance sampling weight of a sample drawn with pdf_a, combined with a strategy of density pdf_b
+inline double power_heuristic(double pdf_a, double pdf_b) {
+    const double a2 = pdf_a * pdf_a;
+    const double b2 = pdf_b * pdf_b;
+    return a2 + b2 > 0 ? a2 / (a2 + b2) : 0.;
+}
+
+// Draws an index with probability proportional to its weight in constant time (Vose's alias method)
+class alias_table {
+
+    public:
+        alias_table() {}
+        explicit alias_table(const std::vector<double>& weights) : entries(weights.size()) {
+            const size_t n = weights.size();
+            double sum = 0;
+            for (double w : weights) sum += w;
+
+            // Scale the weights to an average of one. A slot below one is topped up by the alias of a slot above.
+            std::vector<double> scaled(n);
+            std::vector<uint32_t> small, large;
+            for (size_t i = 0; i < n; ++i) {
+                scaled[i] = sum > 0 ? weights[i] * n / sum : 1.;
+                (scaled[i] < 1. ? small : large).push_back(i);
+            }
+            while (!small.empty() && !large.empty()) {
+                const uint32_t s = small.back(), l = large.back();
+                small.pop_back();
+                entries[s].threshold = scaled[s];
+                entries[s].alias = l;
+                scaled[l] -= 1. - scaled[s];
+                if (scaled[l] < 1.) {
+                    large.pop_back();
+                    small.push_back(l);
+                }
+            }
+            // Whatever is left is one up to rounding
+            for (uint32_t i : small) entries[i] = {1., i};
+            for (uint32_t i : large) entries[i] = {1., i};
+        }
+
+        // u is uniform in [0, 1), its integer part selects the slot and its fraction picks the slot or its alias
+        size_t sample(double u) const {
+            const double x = u * entries.size();
+            const size_t i = std::min(static_cast<size_t>(x), entries.size() - 1);
+            return x - i < entries[i].threshold ? i : entries[i].alias;
+        }
+
+    private:
+        struct entry {
+            double threshold;
+            uint32_t alias;
+        };
+        std::vector<entry> entries;
+};
+
+// Texel of the environment map as fetched while rendering: the radiance, decoded once from the image, together with
+// the sampling density of the texel, so that radiance and MIS pdf of a direction come from one 16 byte load.
+struct alignas(16) env_texel {
+    float radiance[3];
+    float pdf;  // Density over the unit (u, v) square of the map
+};
+
+// Light at infinity given by an equirectangular map. u follows the azimuth around the y axis and v the polar
+// angle, from +y at the top row to -y at the bottom. Directions are importance sampled by texel luminance.
+class environment_light {
+
+    public:
+        environment_light(int width, int height, const std::vector<color>& pixels, double intensity = 1.)
+            : width(width), height(height), texels(static_cast<size_t>(width) * height) {
+            // The texels of a row cover a solid angle proportional to sin(theta), sampling follows their power
+            std::vector<double> weights(texels.size());
+            for (int y = 0; y < height; ++y) {
+                const double sin_theta = std::sin(pi * (y + 0.5) / height);
+                for (int x = 0; x < width; ++x) {
+                    const size_t i = static_cast<size_t>(y) * width + x;
+                    const color c = intensity * pixels[i];
+                    for (int k = 0; k < 3; ++k) texels[i].radiance[k] = static_cast<float>(c[k]);
+                    weights[i] = (0.2126 * c[0] + 0.7152 * c[1] + 0.0722 * c[2]) * sin_theta;
+                }
+            }
+            double sum = 0;
+            for (double w : weights) sum += w;
+            for (size_t i = 0; i < texels.size(); ++i)
+                texels[i].pdf = static_cast<float>(sum > 0 ? weights[i] / sum * texels.size() : 1.);
+            distribution = alias_table(weights);
+        }
+
+        // The white to blue sky gradient the renderer used before environment maps
+        static environment_light sky_gradient(int width = 512, int height = 256) {
+            std::vector<color> pixels(static_cast<size_t>(width) * height);
+            for (int y = 0; y < height; ++y) {
+                auto t = 0.5 * (std::cos(pi * (y + 0.5) / height) + 1.);
+                std::fill(pixels.begin() + y * width, pixels.begin() + (y + 1) * width,
+                          (1.0-t)*color(1.0, 1.0, 1.0) + t*color(0.5, 0.7, 1.0));
+            }
+            return environment_light(width, height, pixels);
+        }
+
+        color radiance(const vec3& direction) const {
+            double sin_theta;
+            const auto& texel = texels[texel_index(direction, sin_theta)];
+            return color(texel.radiance[0], texel.radiance[1], texel.radiance[2]);
+        }
+
+        // Solid angle density of sample() producing direction
+        double pdf(const vec3& direction) const {
+            double sin_theta;
+            const auto& texel = texels[texel_index(direction, sin_theta)];
+            return sin_theta > 0 ? texel.pdf / (2. * pi * pi * sin_theta) : 0.;
+        }
+
+        // Samples a direction towards the environment and returns the radiance arriving from it. The direction
+        // is uniform within a texel drawn from the alias table.
+        color sample(vec3& direction, double& pdf) const {
+            const size_t i = distribution.sample(random_double());
+            const auto& texel = texels[i];
+            const double u = (i % width + random_double()) / width;
+            const double v = (i / width + random_double()) / height;
+            const double phi = 2. * pi * u - pi;
+            const double theta = pi * v;
+            const double sin_theta = std::sin(theta);
+            direction = vec3(sin_theta * std::cos(phi), std::cos(theta), sin_theta * std::sin(phi));
+            pdf = sin_theta > 0 ? texel.pdf / (2. * pi * pi * sin_theta) : 0.;
+            return color(texel.radiance[0], texel.radiance[1], texel.radiance[2]);
+        }
+
+    private:
+        size_t texel_index(const vec3& direction, double& sin_theta) const {
+            const vec3 d = unit_vector(direction);
+            const double cos_theta = clamp(d.y(), -1., 1.);
+            sin_theta = std::sqrt(1. - cos_theta * cos_theta);
+            const double u = (std::atan2(d.z(), d.x()) + pi) / (2. * pi);
+            const double v = std::acos(cos_theta) / pi;
+            const int x = std::min(static_cast<int>(u * width), width - 1);
+            const int y = std::min(static_cast<int>(v * height), height - 1);
+            return static_cast<size_t>(y) * width + x;
+        }
+
+    public:
+        int width;
+        int height;
+
+    private:
+        std::vector<env_texel> texels;
+        alias_table distribution;
+};
+
+#endif
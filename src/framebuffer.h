@@ -0,0 +1,70 @@
+#ifndef FRAMEBUFFER_H_
+#define FRAMEBUFFER_H_
+
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+const size_t page_size = 4096;
+
+// Allocator whose default construction leaves the memory untouched. Buffers using it have to be initialized
+// explicitly, which lets the worker rendering a region be the first to touch its pages, so the kernel places
+// them on that worker's NUMA node.
+template <typename T>
+class first_touch_allocator : public std::allocator<T> {
+
+    public:
+        template <typename U>
+        struct rebind { using other = first_touch_allocator<U>; };
+
+        first_touch_allocator() {}
+
+        template <typename U>
+        first_touch_allocator(const first_touch_allocator<U>&) {}
+
+        // Buffers start on a page boundary, so no page is shared with unrelated data
+        T* allocate(size_t n) {
+#ifdef __linux__
+            void* p = nullptr;
+            if (posix_memalign(&p, page_size, n * sizeof(T)) != 0) throw std::bad_alloc();
+            return static_cast<T*>(p);
+#else
+            return std::allocator<T>::allocate(n);
+#endif
+        }
+
+        void deallocate(T* p, size_t n) {
+#ifdef __linux__
+            (void)n;
+            free(p);
+#else
+            std::allocator<T>::deallocate(p, n);
+#endif
+        }
+
+        template <typename U>
+        void construct(U*) {}
+
+        template <typename U, typename... Args>
+        void construct(U* p, Args&&... args) {
+            ::new(static_cast<void*>(p)) U(std::forward<Args>(args)...);
+        }
+};
+
+// Per-pixel buffer, resize() does not initialize the pixels
+template <typename T>
+using pixel_buffer = std::vector<T, first_touch_allocator<T>>;
+
+// Scanlines are handed to workers in blocks of rows. Blocks are kept small for load balance and are not a whole
+// number of pages: a page straddling two blocks is shared, and lands on the node of whichever worker touches it
+// first. At 400 pixels wide that is one of about 10 pages of a color block and one of 2 of a sample count block.
+const int rows_per_block = 4;
+
+inline uint32_t row_owner(int row, uint32_t num_workers) {
+    return (row / rows_per_block) % num_workers;
+}
+
+#endif
@@ -4,6 +4,7 @@
 #include "ray.h"
 #include "vec3.h"
 #include "utils.h"
+#include "aabb.h"
 
 class material;
 class metal;
@@ -25,6 +26,17 @@ class hittable{
 
     public:
         virtual bool hit(const ray& r, const double t_min, const double t_max, hit_record& rec) const = 0;
+        // Returns false if the object has no finite bounds
+        virtual bool bounding_box(aabb& output_box) const = 0;
+        // Bounds of the part of the object inside box, used to clip references of spatial BVH splits. The default
+        // is the overlap of box and the bounding box.
+        virtual aabb clip_box(const aabb& box) const {
+            aabb bounds;
+            if (!bounding_box(bounds)) return box;
+            return intersect_box(bounds, box);
+        }
+        // Copy of the object for per-NUMA-node scene replication, nullptr if the object is shared instead
+        virtual shared_ptr<hittable> clone() const { return nullptr; }
 
     public:
         shared_ptr<material> mat_ptr;
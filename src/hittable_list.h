@@ -22,6 +22,8 @@ class hittable_list : public hittable{
 
         bool hit(const ray& r, const double t_min, const double t_max, hit_record& rec) const override;
 
+        bool bounding_box(aabb& output_box) const override;
+
     public:
         std::vector<shared_ptr<hittable>> objects;
 };
@@ -41,4 +43,16 @@ bool hittable_list::hit(const ray& r, const double t_min, const double t_max, hi
     return hit_anything;
 }
 
+bool hittable_list::bounding_box(aabb& output_box) const {
+    if (objects.empty()) return false;
+
+    aabb temp_box;
+    output_box = aabb();
+    for (const auto& object : objects) {
+        if (!object->bounding_box(temp_box)) return false;
+        output_box.grow(temp_box);
+    }
+    return true;
+}
+
 #endif
\ No newline at end of file
@@ -1,5 +1,8 @@
 #include <iostream>
 #include <functional>
+#include <iomanip>
+#include <random>
+#include <sstream>
 #include <chrono>
 #include <vector>
 
@@ -8,42 +11,124 @@
 #include "utils.h"
 #include "sphere.h"
 #include "hittable_list.h"
+#include "bvh.h"
 #include "camera.h"
 #include "material.h"
+#include "spectrum.h"
+#include "environment.h"
+#include "read_hdr.h"
 #include "write_img.h"
+#include "denoise.h"
+#include "options.h"
+#include "checkpoint.h"
+#include "framebuffer.h"
 #include "threading/threadpool.h"
 #include "../lib/pngwriter/src/pngwriter.h"
 
-color ray_color(const ray& r, const hittable& world, int depth) {
+// Direct light from the environment at a diffuse hit, MIS weighted against the cosine-weighted BSDF sample that
+// continues the path. Multiplied by the albedo it is the reflected radiance.
+color sample_environment(const hit_record& rec, const hittable& world, const environment_light& env) {
+    thread_local hit_record shadow_rec;
+    vec3 direction;
+    double light_pdf;
+    auto radiance = env.sample(direction, light_pdf);
+    auto cos_theta = dot(direction, rec.normal);
+    if (light_pdf <= 0 || cos_theta <= 0) return color(0, 0, 0);
+    if (world.hit(ray(rec.p, direction), 0.001, infinity, shadow_rec)) return color(0, 0, 0);
+    auto bsdf_pdf = cos_theta / pi;
+    return radiance * (bsdf_pdf / light_pdf * power_heuristic(light_pdf, bsdf_pdf));
+}
+
+// Solid angle pdf of the cosine-weighted direction scattered off a diffuse hit
+double diffuse_pdf(const ray& scattered, const hit_record& rec) {
+    return fmax(0., dot(unit_vector(scattered.direction()), rec.normal)) / pi;
+}
+
+// If aov is set, the first hit of the ray is written to it for the denoiser. bsdf_pdf is the pdf of r if it was
+// scattered off a diffuse surface, which has already sampled the environment directly.
+color ray_color(const ray& r, const hittable& world, const environment_light& env, int depth, aov_sample* aov = nullptr, double bsdf_pdf = 0.) {
     thread_local hit_record rec;
 
     if (depth <= 0) return color(0,0,0);
 
     if (world.hit(r, 0.001, infinity, rec)) {
+        if (aov) {
+            aov->albedo = rec.mat_ptr->surface_albedo();
+            aov->normal = rec.normal;
+            aov->depth = rec.t * r.direction().length();
+        }
         thread_local ray scattered;
         color attenuation;
         if (rec.mat_ptr->scatter(r, rec, attenuation, scattered)) {
             if (rec.mat_ptr->is_light()){
                 return attenuation;
             }
-            return attenuation * ray_color(scattered, world, depth-1);
+            if (rec.mat_ptr->is_diffuse()) {
+                auto direct = sample_environment(rec, world, env);
+                return attenuation * (direct + ray_color(scattered, world, env, depth-1, nullptr, diffuse_pdf(scattered, rec)));
+            }
+            return attenuation * ray_color(scattered, world, env, depth-1);
         }
         return color(0, 0, 0);
     }
     //return color(0, 0, 0);
-    thread_local auto unit_direction = unit_vector(r.direction());
-    thread_local auto t = 0.5 * (unit_direction.y() + 1.);
-    return (1.0-t)*color(1.0, 1.0, 1.0) + t*color(0.5, 0.7, 1.0);
+    auto background = env.radiance(r.direction());
+    if (aov) {
+        aov->albedo = background;
+        aov->normal = vec3(0, 0, 0);
+        aov->depth = aov_miss_depth;
+    }
+    if (bsdf_pdf > 0) background *= power_heuristic(bsdf_pdf, env.pdf(r.direction()));
+    return background;
 }
 
-hittable_list random_scene() {
+// Spectral counterpart of ray_color. The path carries all wavelengths in lambdas until a dispersive material
+// terminates the secondary ones.
+spectrum ray_color_spectral(const ray& r, const hittable& world, const environment_light& env, int depth, wavelengths& lambdas,
+                            aov_sample* aov = nullptr, double bsdf_pdf = 0.) {
+    thread_local hit_record rec;
+
+    if (depth <= 0) return spectrum(0.);
+
+    if (world.hit(r, 0.001, infinity, rec)) {
+        if (aov) {
+            aov->albedo = rec.mat_ptr->surface_albedo();
+            aov->normal = rec.normal;
+            aov->depth = rec.t * r.direction().length();
+        }
+        thread_local ray scattered;
+        spectrum attenuation;
+        if (rec.mat_ptr->scatter_spectral(r, rec, lambdas, attenuation, scattered)) {
+            if (rec.mat_ptr->is_light()){
+                return attenuation;
+            }
+            if (rec.mat_ptr->is_diffuse()) {
+                auto direct = rgb_to_spectrum(sample_environment(rec, world, env), lambdas);
+                return attenuation * (direct + ray_color_spectral(scattered, world, env, depth-1, lambdas, nullptr, diffuse_pdf(scattered, rec)));
+            }
+            return attenuation * ray_color_spectral(scattered, world, env, depth-1, lambdas);
+        }
+        return spectrum(0.);
+    }
+    auto background = env.radiance(r.direction());
+    if (aov) {
+        aov->albedo = background;
+        aov->normal = vec3(0, 0, 0);
+        aov->depth = aov_miss_depth;
+    }
+    if (bsdf_pdf > 0) background *= power_heuristic(bsdf_pdf, env.pdf(r.direction()));
+    return rgb_to_spectrum(background, lambdas);
+}
+
+// Spheres are placed on a (2 * grid)^2 grid around the origin
+hittable_list random_scene(int grid = 11) {
     hittable_list world;
 
     auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
     world.add(make_shared<sphere>(point3(0,-1000,0), 1000, ground_material));
 
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
+    for (int a = -grid; a < grid; a++) {
+        for (int b = -grid; b < grid; b++) {
             auto choose_mat = random_double();
             point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
 
@@ -82,13 +167,32 @@ hittable_list random_scene() {
     return world;
 }
 
-hittable_list small_scene(){
+// A cloud of small spheres filling a cube of side 2 * grid, overlapped by a few giant glass spheres centred inside
+// it. The bounds of every giant cover most of the cloud, the case spatial BVH splits are made for.
+hittable_list giants_scene(int grid = 11) {
+    hittable_list world;
+    const int count = 2 * grid * grid * grid;
+    for (int i = 0; i < count; ++i) {
+        point3 center(random_double(-grid, grid), random_double(-grid, grid), random_double(-grid, grid));
+        auto albedo = color::random() * color::random();
+        world.add(make_shared<sphere>(center, 0.1, make_shared<lambertian>(albedo)));
+    }
+    auto glass = make_shared<dielectric>(1.5);
+    for (int k = 0; k < 8; ++k) {
+        point3 center(random_double(-grid, grid), random_double(-grid, grid), random_double(-grid, grid));
+        world.add(make_shared<sphere>(center, 3. * grid, glass));
+    }
+    return world;
+}
+
+// A Cauchy coefficient above zero makes the glass sphere dispersive
+hittable_list small_scene(double cauchy_b = 0.){
     hittable_list world;
 
     auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
     world.add(make_shared<sphere>(point3(0,-1000,0), 1000, ground_material));
 
-    auto material1 = make_shared<dielectric>(1.5);
+    auto material1 = make_shared<dielectric>(1.5, cauchy_b);
     world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
 
     auto material2 = make_shared<lambertian>(color(0.05, 0.05, 0.35));
@@ -107,16 +211,17 @@ hittable_list small_scene(){
     return world;
 }
 
-int main(){
+int main(int argc, char** argv){
+    render_options opts;
+    if (!parse_options(argc, argv, opts)) return 1;
+
     // Image settings
     const auto aspect_ratio = 16./9.;
     const int img_width = 400;
     const int img_height = static_cast<int>(img_width / aspect_ratio);
-    int samples_per_pixel = 100;
-    int max_depth = 50;
-
-    // World
-    auto world = small_scene();
+    int samples_per_pixel = opts.samples_per_pixel;
+    int max_depth = opts.max_depth;
+    bool denoise = opts.denoise;
 
     // Camera
     point3 lookfrom(13,2,3);
@@ -126,40 +231,164 @@ int main(){
     auto aperture = 0.1;
     camera cam(lookfrom, lookat, vup, 20, aspect_ratio, aperture, dist_to_focus);
 
-    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    // Environment light, the sky gradient unless a map is given
+    auto env = environment_light::sky_gradient();
+    if (!opts.envmap.empty()) {
+        int env_width, env_height;
+        std::vector<color> env_pixels;
+        if (!read_hdr(opts.envmap, env_width, env_height, env_pixels)) return 1;
+        env = environment_light(env_width, env_height, env_pixels, opts.env_intensity);
+        std::cout << "Environment map " << opts.envmap << ": " << env_width << "x" << env_height << std::endl;
+    }
+
     // Create threadpool for multiprocessing
-    uint32_t num_threads = 12;
-    ThreadPool threadpool(num_threads);
+    ThreadPool threadpool(opts.num_threads);
+    const bool numa = opts.numa;
+    if (opts.pin_threads) {
+        auto topology = numa_topology::detect();
+        threadpool.pin_threads(topology);
+        std::cout << "Pinning " << threadpool.num_threads() << " threads to " << topology.num_nodes() << " NUMA node(s)" << std::endl;
+    }
     threadpool.start();
 
-    // Render
-    std::vector<vec3> pixel_colors;
-    pixel_colors.resize(img_height * img_width);
-    pixel_colors[0] = vec3(0, 0, 0);
-    for (int j = img_height - 1; j >= 0; --j) {
-        std::function<void()> fun = [&pixel_colors, j, samples_per_pixel, &cam, &world, max_depth] {
-            for (int i = 0; i < img_width; ++i){
-                vec3 pixel_color(0, 0, 0);
-                for (int s = 0; s != samples_per_pixel; ++s) {
-                    auto u = (i + random_double()) / (img_width - 1);
-                    auto v = (j + random_double()) / (img_height - 1);
-                    pixel_color += ray_color(cam.get_ray(u, v), world, max_depth);
-                }   
-                pixel_colors[j * img_width + i] = pixel_color;
-            }
-        };
-        threadpool.add_job(fun);
+    // Render buffers. In NUMA mode every worker zeroes the scanlines it renders, placing their pages on its node.
+    const int n_pixels = img_height * img_width;
+    pixel_buffer<color> pixel_colors;
+    pixel_colors.resize(n_pixels);
+    pixel_buffer<uint32_t> sample_counts;
+    sample_counts.resize(n_pixels);
+    aov_buffers aovs;
+    if (denoise) aovs.resize(n_pixels);
+    auto clear_row = [&](int j) {
+        const size_t first = j * img_width, last = first + img_width;
+        std::fill(pixel_colors.begin() + first, pixel_colors.begin() + last, color(0, 0, 0));
+        std::fill(sample_counts.begin() + first, sample_counts.begin() + last, 0);
+        if (denoise) aovs.clear(first, last);
+    };
+    if (numa) {
+        const uint32_t n_workers = threadpool.num_threads();
+        threadpool.run_on_workers([&](uint32_t worker) {
+            for (int j = 0; j < img_height; ++j)
+                if (row_owner(j, n_workers) == worker) clear_row(j);
+        });
+    } else {
+        for (int j = 0; j < img_height; ++j) clear_row(j);
     }
 
-    while (threadpool.busy()){
-        std::cout << "\rScanlines remaining: " << threadpool.num_jobs() << " " << std::flush;
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    const bool spectral = opts.spectral != "none";
+    const bool single_wavelength = opts.spectral == "single";
+    const bool deterministic = opts.deterministic;
+    const bool checkpointing = !opts.checkpoint_path.empty();
+    // Checkpointed renders seed every pixel sample as well, a resumed run then continues the sample streams instead
+    // of repeating the ones the checkpoint holds. Without --deterministic each run draws its own seed.
+    const bool seed_samples = deterministic || checkpointing;
+    std::random_device entropy;
+    const uint64_t seed = deterministic ? opts.seed : (static_cast<uint64_t>(entropy()) << 32) ^ entropy();
+    checkpoint_header header = {};
+    header.seed = seed;
+    std::ostringstream scene_settings;
+    scene_settings << std::setprecision(17) << opts.scene << ' ' << opts.grid << ' ' << max_depth << ' '
+                   << opts.env_intensity << ' ' << opts.envmap;
+    header.scene_hash = checkpoint_scene_hash(scene_settings.str());
+    header.width = img_width;
+    header.height = img_height;
+    header.deterministic = deterministic;
+    header.has_aovs = denoise;
+    header.spectral = single_wavelength ? 2 : (spectral ? 1 : 0);
+    if (opts.resume) {
+        if (!load_checkpoint(opts.checkpoint_path, header, pixel_colors, sample_counts, aovs)) {
+            threadpool.stop();
+            return 1;
+        }
+        // All pixels are checkpointed between passes and therefore share the same count
+        if (static_cast<int>(sample_counts[0]) > samples_per_pixel) samples_per_pixel = sample_counts[0];
+        std::cout << "Resuming from " << sample_counts[0] << " samples per pixel" << std::endl;
+    }
+
+    // World
+    hittable_list world;
+    if (opts.scene == "random") world = random_scene(opts.grid);
+    else if (opts.scene == "giants") world = giants_scene(opts.grid);
+    else world = small_scene(opts.scene == "dispersion" ? 0.02 : 0.);
+    shared_ptr<hittable> scene = make_shared<hittable_list>(world);
+    if (opts.bvh != "none") {
+        auto mode = opts.bvh == "lbvh" ? bvh_build_mode::lbvh : (opts.bvh == "sbvh" ? bvh_build_mode::sbvh : bvh_build_mode::sah);
+        auto tree = make_shared<bvh>(world, mode, threadpool);
+        const auto& stats = tree->stats();
+        std::cout << "BVH build (" << opts.bvh << ", " << world.objects.size() << " primitives): " << stats.build_ms << "[ms], SAH cost: "
+                  << stats.sah_cost << ", nodes: " << stats.nodes << ", references: " << stats.references << std::endl;
+        if (opts.replicate_scene) {
+            tree->replicate(threadpool);
+            std::cout << "Scene replicated to " << threadpool.num_nodes() << " NUMA node(s)" << std::endl;
+        }
+        scene = tree;
+    }
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+    // Without checkpoints the whole image is rendered in a single pass
+    const int pass_spp = checkpointing ? opts.pass_spp : samples_per_pixel;
+    auto last_checkpoint = std::chrono::steady_clock::now();
+    for (int pass_end = sample_counts[0] + pass_spp; ; pass_end += pass_spp) {
+        const uint32_t target = std::min(pass_end, samples_per_pixel);
+        for (int j = img_height - 1; j >= 0; --j) {
+            std::function<void()> fun = [&pixel_colors, &sample_counts, &aovs, j, target, &cam, &scene, &env, max_depth, denoise, seed_samples, seed, spectral, single_wavelength] {
+                for (int i = 0; i < img_width; ++i){
+                    const int idx = j * img_width + i;
+                    vec3 pixel_color = pixel_colors[idx];
+                    aov_sample aov;
+                    for (uint32_t s = sample_counts[idx]; s < target; ++s) {
+                        if (seed_samples) seed_thread_rng(sample_seed(i, j, s, seed));
+                        auto u = (i + random_double()) / (img_width - 1);
+                        auto v = (j + random_double()) / (img_height - 1);
+                        if (spectral) {
+                            auto lambdas = wavelengths::sample_hero(random_double());
+                            // Reference mode: one wavelength per path, as if rendering a separate pass per wavelength
+                            if (single_wavelength) lambdas.terminate_secondary();
+                            auto radiance = ray_color_spectral(cam.get_ray(u, v), *scene, env, max_depth, lambdas, denoise ? &aov : nullptr);
+                            pixel_color += spectrum_to_rgb(radiance, lambdas);
+                        } else {
+                            pixel_color += ray_color(cam.get_ray(u, v), *scene, env, max_depth, denoise ? &aov : nullptr);
+                        }
+                        if (denoise) aovs.add(idx, aov);
+                    }
+                    pixel_colors[idx] = pixel_color;
+                    sample_counts[idx] = target;
+                }
+            };
+            if (numa) threadpool.add_job(fun, row_owner(j, threadpool.num_threads()));
+            else threadpool.add_job(fun);
+        }
+
+        while (threadpool.busy()){
+            std::cout << "\rScanlines remaining: " << threadpool.num_jobs() << " " << std::flush;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        threadpool.wait();
+
+        const bool finished = static_cast<int>(target) >= samples_per_pixel;
+        auto now = std::chrono::steady_clock::now();
+        if (checkpointing && (finished || std::chrono::duration<double>(now - last_checkpoint).count() >= opts.checkpoint_interval)) {
+            save_checkpoint(opts.checkpoint_path, header, pixel_colors, sample_counts, aovs);
+            last_checkpoint = now;
+        }
+        if (finished) break;
     }
-    threadpool.stop();
     std::cout << "\rScanlines remaining: 0 " << std::flush;  // Set counter to 0 after finishing
     std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
     std::cout << "Processing time: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << "[ms]" << std::endl;
 
+    if (denoise) {
+        begin = std::chrono::steady_clock::now();
+        denoise_settings settings;
+        settings.iterations = opts.denoise_iterations;
+        atrous_denoiser denoiser(img_width, img_height, settings);
+        denoiser.run(pixel_colors, samples_per_pixel, aovs, threadpool, numa);
+        end = std::chrono::steady_clock::now();
+        std::cout << "Denoising time: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << "[ms]" << std::endl;
+    }
+    threadpool.stop();
+
     pngwriter png(img_width, img_height, 0., "rendering.png");
     write_img(pixel_colors, samples_per_pixel, png);
     std::cout << "Done.\n";
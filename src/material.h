@@ -5,12 +5,24 @@
 #include "vec3.h"
 #include "ray.h"
 #include "hittable.h"
+#include "spectrum.h"
 
 class material{
 
     public:
         virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const = 0;
+        // Spectral variant of scatter. Materials that are not dispersive upsample their RGB attenuation.
+        virtual bool scatter_spectral(const ray& r_in, const hit_record& rec, wavelengths& lambdas, spectrum& attenuation, ray& scattered) const {
+            color rgb_attenuation;
+            if (!scatter(r_in, rec, rgb_attenuation, scattered)) return false;
+            attenuation = rgb_to_spectrum(rgb_attenuation, lambdas);
+            return true;
+        }
         virtual bool is_light() const { return false; }
+        // Diffuse materials scatter with a cosine-weighted pdf and sample the environment light directly
+        virtual bool is_diffuse() const { return false; }
+        // Surface color written to the albedo AOV for the denoiser
+        virtual color surface_albedo() const { return color(1, 1, 1); }
 };
 
 class lambertian : public material {
@@ -30,6 +42,10 @@ class lambertian : public material {
             return true;
         }
 
+        bool is_diffuse() const override { return true; }
+
+        color surface_albedo() const override { return albedo; }
+
     public:
         color albedo;
 };
@@ -45,6 +61,8 @@ class metal : public material {
             return (dot(scattered.direction(), rec.normal) > 0);
         }
 
+        color surface_albedo() const override { return albedo; }
+
     public:
         color albedo;
         double fuzz;
@@ -61,6 +79,8 @@ class light : public material {
 
         bool is_light() const override {return true;}
 
+        color surface_albedo() const override { return albedo; }
+
     public:
         color albedo;
         double intensity;
@@ -68,11 +88,40 @@ class light : public material {
 
 class dielectric : public material {
     public:
-        dielectric(double index_of_refraction) : ir(index_of_refraction) {}
+        // A Cauchy coefficient b in um^2 makes the material dispersive, ir is then the index at the sodium d-line (589.3 nm)
+        dielectric(double index_of_refraction, double b = 0.) : ir(index_of_refraction), cauchy_b(b) {}
 
         bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
             attenuation = color(1.0, 1.0, 1.0);
-            double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
+            scattered = ray(rec.p, scatter_direction(r_in, rec, ir));
+            return true;
+        }
+
+        bool scatter_spectral(const ray& r_in, const hit_record& rec, wavelengths& lambdas, spectrum& attenuation, ray& scattered) const override {
+            double index = ir;
+            if (cauchy_b != 0) {
+                // Each wavelength refracts differently, only the hero wavelength follows this path
+                lambdas.terminate_secondary();
+                index = index_of_refraction(lambdas[0]);
+            }
+            attenuation = spectrum(1.);
+            scattered = ray(rec.p, scatter_direction(r_in, rec, index));
+            return true;
+        }
+
+        // Cauchy's equation, shifted so that the index at the d-line is ir
+        double index_of_refraction(double lambda) const {
+            const double lambda_um = lambda * 1e-3;
+            return ir + cauchy_b * (1. / (lambda_um * lambda_um) - 1. / (0.5893 * 0.5893));
+        }
+
+    public:
+        double ir;
+        double cauchy_b;
+
+    private:
+        static vec3 scatter_direction(const ray& r_in, const hit_record& rec, double index) {
+            double refraction_ratio = rec.front_face ? (1.0 / index) : index;
             
             vec3 unit_direction = unit_vector(r_in.direction());
             double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
@@ -84,15 +133,9 @@ class dielectric : public material {
                 direction = reflect(unit_direction, rec.normal);
             else
                 direction = refract(unit_direction, rec.normal, refraction_ratio);
-
-            scattered = ray(rec.p, direction);
-            return true;
+            return direction;
         }
 
-    public:
-        double ir;
-
-    private:
         static double reflectance(double cosine, double ref_idx) {
             auto r0 = (1 - ref_idx) / (1 + ref_idx);
             r0 = r0*r0;
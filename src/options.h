@@ -0,0 +1,141 @@
+#ifndef OPTIONS_H_
+#define OPTIONS_H_
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+// The last a-trous pass spaces its taps 2^9 pixels apart, enough for any image size rendered here
+const int max_denoise_iterations = 10;
+
+struct render_options {
+    int samples_per_pixel = 100;
+    int max_depth = 50;
+    bool denoise = false;
+    int denoise_iterations = 5;
+    bool deterministic = false;
+    uint64_t seed = 0;
+    std::string checkpoint_path;
+    double checkpoint_interval = 60.;
+    int pass_spp = 16;
+    bool resume = false;
+    std::string scene = "small";
+    int grid = 11;
+    std::string bvh = "sah";
+    uint32_t num_threads = 12;
+    bool pin_threads = false;
+    bool numa = false;
+    bool replicate_scene = false;
+    std::string spectral = "none";
+    std::string envmap;
+    double env_intensity = 1.;
+};
+
+inline void print_usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [options]\n"
+              << "  --spp N                 Samples per pixel (default 100)\n"
+              << "  --max-depth N           Maximum path depth (default 50)\n"
+              << "  --denoise               Write albedo/normal/depth AOVs and denoise the result\n"
+              << "  --denoise-iterations N  Number of a-trous filter passes (default 5, at most 10)\n"
+              << "  --deterministic         Seed every pixel sample from (pixel, sample, seed)\n"
+              << "  --seed N                Seed of the deterministic mode (default 0)\n"
+              << "  --checkpoint PATH       Periodically save the accumulation buffer to PATH\n"
+              << "  --checkpoint-interval S Minimum seconds between checkpoints (default 60)\n"
+              << "  --pass-spp N            Samples per pixel rendered between checkpoints (default 16)\n"
+              << "  --resume                Continue from the checkpoint and top up to --spp samples\n"
+              << "  --scene NAME            small, dispersion, random or giants (default small)\n"
+              << "  --grid N                Size of the random and giants scenes, see README (default 11)\n"
+              << "  --bvh MODE              none, lbvh, sah or sbvh, see README (default sah)\n"
+              << "  --threads N             Number of worker threads (default 12)\n"
+              << "  --pin-threads           Pin workers to CPUs, spread over the NUMA nodes\n"
+              << "  --numa                  Pin workers and let each first-touch and render its own scanlines\n"
+              << "  --replicate-scene       Pin workers and copy the BVH and its primitives to every NUMA node\n"
+              << "  --spectral MODE         none, hero (4 wavelengths per path) or single (1 per path) (default none)\n"
+              << "  --envmap PATH           Light the scene with an equirectangular Radiance .hdr map instead of the sky\n"
+              << "  --env-intensity S       Scale of the environment map radiance (default 1)\n";
+}
+
+// Returns false if the arguments are invalid or the usage was requested
+inline bool parse_options(int argc, char** argv, render_options& opts) {
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (!strcmp(arg, "--spp") && has_value) {
+            opts.samples_per_pixel = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--max-depth") && has_value) {
+            opts.max_depth = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--denoise")) {
+            opts.denoise = true;
+        } else if (!strcmp(arg, "--denoise-iterations") && has_value) {
+            opts.denoise_iterations = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--deterministic")) {
+            opts.deterministic = true;
+        } else if (!strcmp(arg, "--seed") && has_value) {
+            opts.seed = strtoull(argv[++i], nullptr, 10);
+        } else if (!strcmp(arg, "--checkpoint") && has_value) {
+            opts.checkpoint_path = argv[++i];
+        } else if (!strcmp(arg, "--checkpoint-interval") && has_value) {
+            opts.checkpoint_interval = atof(argv[++i]);
+        } else if (!strcmp(arg, "--pass-spp") && has_value) {
+            opts.pass_spp = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--resume")) {
+            opts.resume = true;
+        } else if (!strcmp(arg, "--scene") && has_value) {
+            opts.scene = argv[++i];
+        } else if (!strcmp(arg, "--grid") && has_value) {
+            opts.grid = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--bvh") && has_value) {
+            opts.bvh = argv[++i];
+        } else if (!strcmp(arg, "--threads") && has_value) {
+            opts.num_threads = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--pin-threads")) {
+            opts.pin_threads = true;
+        } else if (!strcmp(arg, "--numa")) {
+            opts.numa = opts.pin_threads = true;
+        } else if (!strcmp(arg, "--spectral") && has_value) {
+            opts.spectral = argv[++i];
+        } else if (!strcmp(arg, "--envmap") && has_value) {
+            opts.envmap = argv[++i];
+        } else if (!strcmp(arg, "--env-intensity") && has_value) {
+            opts.env_intensity = atof(argv[++i]);
+        } else if (!strcmp(arg, "--replicate-scene")) {
+            opts.replicate_scene = opts.pin_threads = true;
+        } else {
+            print_usage(argv[0]);
+            return false;
+        }
+    }
+    if (opts.samples_per_pixel <= 0 || opts.max_depth <= 0 || opts.denoise_iterations < 0 || opts.pass_spp <= 0 || opts.num_threads == 0) {
+        std::cerr << "Sample counts, depth and iterations must be positive" << std::endl;
+        return false;
+    }
+    if (opts.denoise_iterations > max_denoise_iterations) {
+        std::cerr << "At most " << max_denoise_iterations << " denoise iterations are supported" << std::endl;
+        return false;
+    }
+    if (opts.env_intensity <= 0) {
+        std::cerr << "Environment intensity must be positive" << std::endl;
+        return false;
+    }
+    if (opts.spectral != "none" && opts.spectral != "hero" && opts.spectral != "single") {
+        std::cerr << "Unknown spectral mode " << opts.spectral << std::endl;
+        return false;
+    }
+    if (opts.scene != "small" && opts.scene != "dispersion" && opts.scene != "random" && opts.scene != "giants") {
+        std::cerr << "Unknown scene " << opts.scene << std::endl;
+        return false;
+    }
+    if (opts.bvh != "none" && opts.bvh != "lbvh" && opts.bvh != "sah" && opts.bvh != "sbvh") {
+        std::cerr << "Unknown BVH mode " << opts.bvh << std::endl;
+        return false;
+    }
+    if (opts.resume && opts.checkpoint_path.empty()) {
+        std::cerr << "--resume requires --checkpoint" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef READ_HDR_H_
+#define READ_HDR_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "vec3.h"
+
+inline color rgbe_to_color(const unsigned char rgbe[4]) {
+    if (rgbe[3] == 0) return color(0, 0, 0);
+    const double f = std::ldexp(1., rgbe[3] - (128 + 8));
+    return color(rgbe[0] * f, rgbe[1] * f, rgbe[2] * f);
+}
+
+// Read one scanline of run-length encoded RGBE pixels. Each of the four channels is stored separately as runs
+// (count > 128, one byte repeated count - 128 times) and literal byte sequences.
+inline bool read_hdr_rle_scanline(std::ifstream& in, int width, std::vector<unsigned char>& scanline) {
+    for (int c = 0; c < 4; ++c) {
+        for (int i = 0; i < width; ) {
+            int count = in.get();
+            if (count == EOF || count == 0) return false;
+            if (count > 128) {
+                count -= 128;
+                const int value = in.get();
+                if (value == EOF || i + count > width) return false;
+                for (int k = 0; k < count; ++k, ++i) scanline[4 * i + c] = static_cast<unsigned char>(value);
+            } else {
+                if (i + count > width) return false;
+                for (int k = 0; k < count; ++k, ++i) scanline[4 * i + c] = static_cast<unsigned char>(in.get());
+            }
+        }
+    }
+    return static_cast<bool>(in);
+}
+
+// Read a Radiance RGBE (.hdr) image with the standard -Y H +X W orientation, top scanline first. Both flat and
+// run-length encoded scanlines are supported, the old-style RLE of pre-1991 files is not.
+bool read_hdr(const std::string& path, int& width, int& height, std::vector<color>& pixels) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        std::cerr << "HDR: Cannot open " << path << std::endl;
+        return false;
+    }
+    std::string line;
+    std::getline(in, line);
+    if (line.compare(0, 2, "#?") != 0) {
+        std::cerr << "HDR: " << path << " is not a Radiance HDR file" << std::endl;
+        return false;
+    }
+    // Header lines up to an empty line
+    while (std::getline(in, line) && !line.empty()) {
+        if (line.compare(0, 7, "FORMAT=") == 0 && line != "FORMAT=32-bit_rle_rgbe") {
+            std::cerr << "HDR: Unsupported " << line << std::endl;
+            return false;
+        }
+    }
+    std::getline(in, line);
+    if (!in || std::sscanf(line.c_str(), "-Y %d +X %d", &height, &width) != 2 || width <= 0 || height <= 0) {
+        std::cerr << "HDR: Unsupported resolution line \"" << line << "\"" << std::endl;
+        return false;
+    }
+
+    pixels.resize(static_cast<size_t>(width) * height);
+    std::vector<unsigned char> scanline(4 * width);
+    for (int j = 0; j < height; ++j) {
+        unsigned char start[4];
+        in.read(reinterpret_cast<char*>(start), 4);
+        const bool rle = width >= 8 && width < 32768 && start[0] == 2 && start[1] == 2 && ((start[2] << 8) | start[3]) == width;
+        bool ok = static_cast<bool>(in);
+        if (ok && rle) {
+            ok = read_hdr_rle_scanline(in, width, scanline);
+        } else if (ok) {
+            std::copy(start, start + 4, scanline.begin());
+            in.read(reinterpret_cast<char*>(scanline.data()) + 4, 4 * (width - 1));
+            ok = static_cast<bool>(in);
+        }
+        if (!ok) {
+            std::cerr << "HDR: " << path << " is truncated or corrupt at scanline " << j << std::endl;
+            return false;
+        }
+        for (int i = 0; i < width; ++i) pixels[static_cast<size_t>(j) * width + i] = rgbe_to_color(&scanline[4 * i]);
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,194 @@
+#ifndef SPECTRUM_H_
+#define SPECTRUM_H_
+
+#include <cmath>
+
+#include "utils.h"
+#include "vec3.h"
+
+// Wavelengths carried by one path. 4 doubles fill an AVX register, 8 would match AVX-512.
+const int spectral_samples = 4;
+constexpr double lambda_min = 380.;
+constexpr double lambda_max = 730.;
+
+// Values of a path at each of its wavelengths. The fixed-size lane loops are vectorized by the compiler, so a
+// path shades all its wavelengths at the cost of one.
+class spectrum {
+
+    public:
+        spectrum() : spectrum(0.) {}
+        explicit spectrum(double x) {
+            for (int i = 0; i < spectral_samples; ++i) v[i] = x;
+        }
+
+        double operator[](int i) const { return v[i]; }
+        double& operator[](int i) { return v[i]; }
+
+        spectrum& operator+=(const spectrum& s) {
+            for (int i = 0; i < spectral_samples; ++i) v[i] += s.v[i];
+            return *this;
+        }
+
+        spectrum& operator*=(const spectrum& s) {
+            for (int i = 0; i < spectral_samples; ++i) v[i] *= s.v[i];
+            return *this;
+        }
+
+    public:
+        alignas(32) double v[spectral_samples];
+};
+
+inline spectrum operator*(spectrum a, const spectrum& b) {
+    return a *= b;
+}
+
+inline spectrum operator+(spectrum a, const spectrum& b) {
+    return a += b;
+}
+
+// Hero wavelength sampling (Wilkie et al. 2014): the hero wavelength is uniform over the visible range and the
+// others are evenly spaced after it, wrapping around at the end of the range.
+class wavelengths {
+
+    public:
+        static wavelengths sample_hero(double u) {
+            wavelengths w;
+            const double range = lambda_max - lambda_min;
+            for (int i = 0; i < spectral_samples; ++i) {
+                w.lambda[i] = lambda_min + std::fmod(u * range + i * range / spectral_samples, range);
+                w.pdf[i] = 1. / range;
+            }
+            return w;
+        }
+
+        double operator[](int i) const { return lambda[i]; }
+
+        // At a dispersive interface the wavelengths would leave in different directions. Only the hero
+        // continues, its pdf accounts for the other wavelengths it now stands in for.
+        void terminate_secondary() {
+            if (secondary_terminated()) return;
+            for (int i = 1; i < spectral_samples; ++i) pdf[i] = 0;
+            pdf[0] /= spectral_samples;
+        }
+
+        bool secondary_terminated() const { return pdf[1] == 0; }
+
+    public:
+        double lambda[spectral_samples];
+        double pdf[spectral_samples];
+};
+
+// CIE 1931 color matching functions, multi-lobe Gaussian fit by Wyman, Sloan and Shirley (2013)
+inline double cie_lobe(double lambda, double mu, double sigma1, double sigma2) {
+    const double t = (lambda - mu) / (lambda < mu ? sigma1 : sigma2);
+    return std::exp(-0.5 * t * t);
+}
+
+inline vec3 cie_xyz(double lambda) {
+    const double x = 1.056 * cie_lobe(lambda, 599.8, 37.9, 31.0) + 0.362 * cie_lobe(lambda, 442.0, 16.0, 26.7)
+                   - 0.065 * cie_lobe(lambda, 501.1, 20.4, 26.2);
+    const double y = 0.821 * cie_lobe(lambda, 568.8, 46.9, 40.5) + 0.286 * cie_lobe(lambda, 530.9, 16.3, 31.1);
+    const double z = 1.217 * cie_lobe(lambda, 437.0, 11.8, 36.0) + 0.681 * cie_lobe(lambda, 459.0, 26.0, 13.8);
+    return vec3(x, y, z);
+}
+
+inline color xyz_to_linear_srgb(const vec3& xyz) {
+    return color( 3.2406 * xyz[0] - 1.5372 * xyz[1] - 0.4986 * xyz[2],
+                 -0.9689 * xyz[0] + 1.8758 * xyz[1] + 0.0415 * xyz[2],
+                  0.0557 * xyz[0] - 0.2040 * xyz[1] + 1.0570 * xyz[2]);
+}
+
+inline double smoothstep(double edge0, double edge1, double x) {
+    const double t = clamp((x - edge0) / (edge1 - edge0), 0., 1.);
+    return t * t * (3. - 2. * t);
+}
+
+// Lookup tables sampled every nanometer over the visible range. RGB colors are upsampled to spectra with
+// three smooth red, green and blue basis functions that sum to one, so white stays flat and reflectances
+// stay within [0, 1]. The response maps spectra back to RGB and is normalized against the basis, so that
+// converting an RGB color to a spectrum and back returns the same color.
+class spectral_tables {
+
+    public:
+        static const int size = static_cast<int>(lambda_max - lambda_min) + 1;
+
+        static const spectral_tables& get() {
+            static const spectral_tables tables;
+            return tables;
+        }
+
+        // Linear interpolation of table t at wavelength lambda
+        static double lookup(const double* t, double lambda) {
+            const double x = clamp(lambda - lambda_min, 0., size - 1.);
+            const int i = std::min(static_cast<int>(x), size - 2);
+            const double f = x - i;
+            return (1. - f) * t[i] + f * t[i + 1];
+        }
+
+    private:
+        spectral_tables() {
+            double m[3][3] = {{0}};
+            vec3 cmf_rgb[size];
+            for (int i = 0; i < size; ++i) {
+                const double lambda = lambda_min + i;
+                const double t_bg = smoothstep(480., 510., lambda);
+                const double t_gr = smoothstep(570., 600., lambda);
+                basis[0][i] = t_gr;
+                basis[1][i] = t_bg - t_gr;
+                basis[2][i] = 1. - t_bg;
+                cmf_rgb[i] = xyz_to_linear_srgb(cie_xyz(lambda));
+                for (int j = 0; j < 3; ++j)
+                    for (int k = 0; k < 3; ++k)
+                        m[j][k] += cmf_rgb[i][j] * basis[k][i];
+            }
+            double m_inv[3][3];
+            invert3x3(m, m_inv);
+            for (int i = 0; i < size; ++i)
+                for (int c = 0; c < 3; ++c)
+                    response[c][i] = m_inv[c][0] * cmf_rgb[i][0] + m_inv[c][1] * cmf_rgb[i][1] + m_inv[c][2] * cmf_rgb[i][2];
+        }
+
+        static void invert3x3(const double m[3][3], double inv[3][3]) {
+            const double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+                             - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+                             + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+            for (int r = 0; r < 3; ++r) {
+                for (int c = 0; c < 3; ++c) {
+                    // Cofactor of m[c][r], the adjugate is the transposed cofactor matrix
+                    const int r0 = (c + 1) % 3, r1 = (c + 2) % 3, c0 = (r + 1) % 3, c1 = (r + 2) % 3;
+                    inv[r][c] = (m[r0][c0] * m[r1][c1] - m[r0][c1] * m[r1][c0]) / det;
+                }
+            }
+        }
+
+    public:
+        double basis[3][size];     // Red, green and blue basis spectra
+        double response[3][size];  // Spectrum to RGB response, per unit wavelength
+};
+
+inline spectrum rgb_to_spectrum(const color& c, const wavelengths& lambdas) {
+    const auto& tables = spectral_tables::get();
+    spectrum s;
+    for (int i = 0; i < spectral_samples; ++i) {
+        s[i] = c[0] * spectral_tables::lookup(tables.basis[0], lambdas[i])
+             + c[1] * spectral_tables::lookup(tables.basis[1], lambdas[i])
+             + c[2] * spectral_tables::lookup(tables.basis[2], lambdas[i]);
+    }
+    return s;
+}
+
+// Monte Carlo estimate of the RGB color of the spectrum, averaged over the path's wavelengths
+inline color spectrum_to_rgb(const spectrum& s, const wavelengths& lambdas) {
+    const auto& tables = spectral_tables::get();
+    color c(0, 0, 0);
+    for (int i = 0; i < spectral_samples; ++i) {
+        if (lambdas.pdf[i] == 0) continue;
+        const double w = s[i] / (lambdas.pdf[i] * spectral_samples);
+        c += w * color(spectral_tables::lookup(tables.response[0], lambdas[i]),
+                       spectral_tables::lookup(tables.response[1], lambdas[i]),
+                       spectral_tables::lookup(tables.response[2], lambdas[i]));
+    }
+    return c;
+}
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef SPHERE_H_
 #define SPHERE_H_
 
+#include <algorithm>
 #include <cmath>
 #include "hittable.h"
 #include "material.h"
@@ -13,6 +14,12 @@ class sphere : public hittable{
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
 
+        virtual bool bounding_box(aabb& output_box) const override;
+
+        virtual aabb clip_box(const aabb& box) const override;
+
+        virtual shared_ptr<hittable> clone() const override { return make_shared<sphere>(*this); }
+
     public:
         point3 center;
         double radius;
@@ -42,4 +49,37 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
     rec.set_face_normal(r, outward_normal);
     return true;
 }
+
+bool sphere::bounding_box(aabb& output_box) const {
+    output_box = aabb(center - vec3(radius, radius, radius), center + vec3(radius, radius, radius));
+    return true;
+}
+
+// Within the slab of box along each axis, the sphere is bounded by the circle at the slab's closest point to the
+// center. Intersecting these three bounds is conservative and much tighter than box alone for a cap of the sphere.
+// A box inside the ball does not contain any of the surface.
+aabb sphere::clip_box(const aabb& box) const {
+    double far = 0;
+    for (int a = 0; a < 3; ++a) {
+        const double d = std::max(std::fabs(box.minimum[a] - center[a]), std::fabs(box.maximum[a] - center[a]));
+        far += d * d;
+    }
+    if (far < radius * radius) return aabb();
+    aabb clipped = box;
+    for (int a = 0; a < 3; ++a) {
+        const double lo = std::max(box.minimum[a], center[a] - radius);
+        const double hi = std::min(box.maximum[a], center[a] + radius);
+        if (lo > hi) return aabb();
+        const double d = center[a] < lo ? lo - center[a] : (center[a] > hi ? center[a] - hi : 0.);
+        const double r = std::sqrt(std::max(0., radius * radius - d * d));
+        clipped.minimum[a] = std::max(clipped.minimum[a], lo);
+        clipped.maximum[a] = std::min(clipped.maximum[a], hi);
+        for (int k = 1; k < 3; ++k) {
+            const int b = (a + k) % 3;
+            clipped.minimum[b] = std::max(clipped.minimum[b], center[b] - r);
+            clipped.maximum[b] = std::min(clipped.maximum[b], center[b] + r);
+        }
+    }
+    return clipped;
+}
 #endif
\ No newline at end of file
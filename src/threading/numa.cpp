@@ -0,0 +1,70 @@
+#include "numa.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+std::vector<int> parse_cpulist(const std::string& list){
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')){
+        if (range.empty())
+            continue;
+        auto dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+// CPUs in the affinity mask of the process, empty if unknown. Inside a cpuset or container sysfs still lists all
+// CPUs of the host.
+static std::vector<int> allowed_cpus(){
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0){
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &allowed))
+                cpus.push_back(cpu);
+    }
+#endif
+    return cpus;
+}
+
+numa_topology numa_topology::detect(){
+    numa_topology topology;
+    const std::vector<int> allowed = allowed_cpus();
+    std::ifstream online("/sys/devices/system/node/online");
+    std::string nodes;
+    if (online)
+        std::getline(online, nodes);
+    for (int node : parse_cpulist(nodes)){
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string list;
+        if (!file || !std::getline(file, list))
+            continue;
+        // Memory-only nodes, and nodes whose CPUs are all outside the affinity mask, cannot run workers
+        std::vector<int> cpus;
+        for (int cpu : parse_cpulist(list))
+            if (allowed.empty() || std::binary_search(allowed.begin(), allowed.end(), cpu))
+                cpus.push_back(cpu);
+        if (!cpus.empty())
+            topology.node_cpus.push_back(cpus);
+    }
+    if (topology.node_cpus.empty()){
+        topology.node_cpus.resize(1);
+        topology.node_cpus[0] = allowed;
+        if (allowed.empty())
+            for (unsigned cpu = 0; cpu < std::thread::hardware_concurrency(); ++cpu)
+                topology.node_cpus[0].push_back(cpu);
+    }
+    return topology;
+}
@@ -0,0 +1,20 @@
+#ifndef NUMA_H_
+#define NUMA_H_
+
+#include <string>
+#include <vector>
+
+// CPUs of each NUMA node that the process may run on, read from sysfs. Systems without NUMA information are
+// reported as a single node holding all allowed hardware threads.
+struct numa_topology {
+    std::vector<std::vector<int>> node_cpus;
+
+    static numa_topology detect();
+
+    size_t num_nodes() const { return node_cpus.size(); }
+};
+
+// Parses a kernel cpulist such as "0-3,8,10-11"
+std::vector<int> parse_cpulist(const std::string& list);
+
+#endif
@@ -3,18 +3,75 @@
 #include <thread>
 #include <functional>
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+static thread_local int this_worker = -1;
+static thread_local uint32_t this_node = 0;
+
+int ThreadPool::current_worker(){
+    return this_worker;
+}
+
+uint32_t ThreadPool::current_node(){
+    return this_node;
+}
+
+void ThreadPool::pin_threads(const numa_topology& topology){
+    n_nodes = topology.num_nodes();
+    std::vector<size_t> next_cpu(n_nodes, 0);
+    for (uint32_t i = 0; i < n_threads; ++i){
+        uint32_t node = i % n_nodes;
+        const auto& cpus = topology.node_cpus[node];
+        worker_nodes[i] = node;
+        worker_cpus[i] = cpus[next_cpu[node]++ % cpus.size()];
+    }
+}
 
 void ThreadPool::add_job(std::function<void()>& fun){
     {
         std::lock_guard<std::mutex> lock(mutex);
         job_pool.push_back(fun);
+        ++queued_jobs;
     }
     mutex_condition.notify_one();
 }
 
+void ThreadPool::add_job(std::function<void()>& fun, uint32_t worker){
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        local_pool[worker % n_threads].push_back(fun);
+        ++queued_jobs;
+    }
+    mutex_condition.notify_one();
+}
+
+void ThreadPool::run_on_workers(const std::function<void(uint32_t)>& fun){
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (uint32_t i = 0; i < n_threads; ++i)
+            pinned_pool[i].push_back([&fun, i]{ fun(i); });
+    }
+    // Pinned jobs can only be taken by their own worker, so every worker has to check its queue
+    mutex_condition.notify_all();
+    wait();
+}
+
 void ThreadPool::start(){
+    thread_pool.resize(n_threads);
     for (uint32_t i = 0; i < n_threads; ++i){
-        thread_pool.push_back(std::thread(&ThreadPool::thread_loop, this));
+        thread_pool[i] = std::thread(&ThreadPool::thread_loop, this, i);
+#ifdef __linux__
+        if (worker_cpus[i] >= 0){
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(worker_cpus[i], &cpuset);
+            if (pthread_setaffinity_np(thread_pool[i].native_handle(), sizeof(cpu_set_t), &cpuset) != 0)
+                std::cerr << "ThreadPool: Failed to pin worker " << i << " to CPU " << worker_cpus[i] << std::endl;
+        }
+#endif
     }
 }
 
@@ -35,31 +92,80 @@ int ThreadPool::num_jobs(){
     int n_jobs;
     {
         std::lock_guard<std::mutex> lock(mutex);
-        n_jobs = job_pool.size();
+        n_jobs = queued_jobs;
+        for (const auto& pinned : pinned_pool)
+            n_jobs += pinned.size();
     }
     return n_jobs;
 }
 
 bool ThreadPool::busy() {
-    bool is_busy;
-    {
-        std::lock_guard<std::mutex> lock(mutex);
-        is_busy = !job_pool.empty();
+    return num_jobs() > 0;
+}
+
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle_condition.wait(lock, [this]{
+        if (queued_jobs > 0 || active_jobs > 0)
+            return false;
+        for (const auto& pinned : pinned_pool)
+            if (!pinned.empty())
+                return false;
+        return true;
+    });
+}
+
+bool ThreadPool::has_job(uint32_t worker) const {
+    return queued_jobs > 0 || !pinned_pool[worker].empty();
+}
+
+// Order of preference: pinned jobs, own queue, shared queue, then steal from the back of another worker's queue
+std::function<void()> ThreadPool::pop_job(uint32_t worker){
+    std::function<void()> job;
+    if (!pinned_pool[worker].empty()){
+        job = pinned_pool[worker].front();
+        pinned_pool[worker].pop_front();
+        return job;
+    }
+    --queued_jobs;
+    if (!local_pool[worker].empty()){
+        job = local_pool[worker].front();
+        local_pool[worker].pop_front();
+    } else if (!job_pool.empty()){
+        job = job_pool.front();
+        job_pool.pop_front();
+    } else {
+        for (uint32_t i = 1; i < n_threads; ++i){
+            auto& victim = local_pool[(worker + i) % n_threads];
+            if (!victim.empty()){
+                job = victim.back();
+                victim.pop_back();
+                break;
+            }
+        }
     }
-    return is_busy;
+    return job;
 }
 
-void ThreadPool::thread_loop(){
+void ThreadPool::thread_loop(uint32_t worker){
+    this_worker = worker;
+    this_node = worker_nodes[worker];
     while(true){
         std::function<void()> job;
         {
             std::unique_lock<std::mutex> lock(mutex);
-            mutex_condition.wait(lock, [this]{ return !job_pool.empty() || terminate_threads;});
+            mutex_condition.wait(lock, [this, worker]{ return has_job(worker) || terminate_threads;});
             if (terminate_threads)
                 return;
-            job = job_pool.front();
-            job_pool.pop_front();
+            job = pop_job(worker);
+            ++active_jobs;
         }
         job();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            --active_jobs;
+            if (active_jobs == 0)
+                idle_condition.notify_all();
+        }
     }
-}
\ No newline at end of file
+}
@@ -10,6 +10,8 @@
 #include <condition_variable>
 #include <iostream>
 
+#include "numa.h"
+
 class ThreadPool {
 
     public:
@@ -18,32 +20,73 @@ class ThreadPool {
             if (n_threads < num_threads)
                 std::cerr << "ThreadPool: Limiting number of threads to number of hardware threads (" << n_threads << ")" << std::endl;
             thread_pool.resize(n_threads);
+            local_pool.resize(n_threads);
+            pinned_pool.resize(n_threads);
+            worker_cpus.assign(n_threads, -1);
+            worker_nodes.assign(n_threads, 0);
             terminate_threads = false;
+            active_jobs = 0;
+            queued_jobs = 0;
+            n_nodes = 1;
         }
 
+        // Pin the workers to CPUs, spread round-robin over the NUMA nodes. Must be called before start().
+        void pin_threads(const numa_topology& topology);
+
         void add_job(std::function<void()>& fun);
 
+        // Queue a job for a specific worker, e.g. one that first touched the memory the job works on.
+        // Idle workers steal it once their own queue and the shared queue are empty.
+        void add_job(std::function<void()>& fun, uint32_t worker);
+
+        // Run fun(worker) exactly once on every worker and block until all calls have returned
+        void run_on_workers(const std::function<void(uint32_t)>& fun);
+
         void stop();
 
         void start();
 
         bool busy();
 
+        // Block until the job queue is empty and all running jobs have finished
+        void wait();
+
         int num_jobs();
 
         uint32_t num_threads() const { return n_threads; };
-    
+
+        uint32_t num_nodes() const { return n_nodes; };
+
+        uint32_t worker_node(uint32_t worker) const { return worker_nodes[worker]; };
+
+        // Index and NUMA node of the calling worker. Threads outside of any pool report worker -1 on node 0.
+        static int current_worker();
+
+        static uint32_t current_node();
+
     private:
 
-        void thread_loop();
+        void thread_loop(uint32_t worker);
+
+        bool has_job(uint32_t worker) const;
+
+        std::function<void()> pop_job(uint32_t worker);
 
     private:
         bool terminate_threads;
         uint32_t n_threads;
+        uint32_t n_nodes;
+        uint32_t active_jobs;
+        uint32_t queued_jobs;  // Jobs in the shared and the per-worker queues, pinned jobs excluded
         std::vector<std::thread> thread_pool;
         std::deque<std::function<void()>> job_pool;
+        std::vector<std::deque<std::function<void()>>> local_pool;
+        std::vector<std::deque<std::function<void()>>> pinned_pool;
+        std::vector<int> worker_cpus;
+        std::vector<uint32_t> worker_nodes;
         std::mutex mutex;
         std::condition_variable mutex_condition;
+        std::condition_variable idle_condition;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -2,6 +2,8 @@
 #define UTILS_H_
 
 #include <cmath>
+#include <cstdint>
+#include <initializer_list>
 #include <limits>
 #include <memory>
 #include <random>
@@ -17,16 +19,72 @@ inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.;
 }
 
+// splitmix64 generator. Its 64 bit state takes sample_seed whole, where the minimal standard engine folded it into
+// fewer than 2^31 streams, and reseeding it per pixel sample is free unlike std::mt19937_64.
+class splitmix64_engine {
+    public:
+        using result_type = uint64_t;
+
+        explicit splitmix64_engine(uint64_t seed = 0) : state(seed) {}
+
+        void seed(uint64_t s) { state = s; }
+
+        static constexpr result_type min() { return 0; }
+        static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+        result_type operator()() {
+            uint64_t x = (state += 0x9e3779b97f4a7c15ULL);
+            x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+            return x ^ (x >> 31);
+        }
+
+    private:
+        uint64_t state;
+};
+
+// Random state of a thread. Uniform and normal samples share one engine so a single seed fixes both streams.
+struct rng_state {
+    splitmix64_engine engine;
+    std::uniform_real_distribution<double> uniform{0.0, 1.0};
+    std::normal_distribution<double> normal;
+};
+
+inline rng_state& thread_rng() {
+    thread_local static rng_state state;
+    return state;
+}
+
+// Restart the random stream of the calling thread. The distributions are reset as well, the normal
+// distribution caches its second sample.
+inline void seed_thread_rng(uint64_t seed) {
+    auto& state = thread_rng();
+    state.engine.seed(seed);
+    state.uniform.reset();
+    state.normal.reset();
+}
+
+// Seed of the random stream of a single pixel sample (splitmix64 finalizer), independent of the thread
+// that renders it
+inline uint64_t sample_seed(uint32_t i, uint32_t j, uint32_t s, uint64_t seed) {
+    uint64_t x = seed;
+    for (uint64_t v : {static_cast<uint64_t>(i), static_cast<uint64_t>(j), static_cast<uint64_t>(s)}) {
+        x += 0x9e3779b97f4a7c15ULL + v;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+    }
+    return x;
+}
+
 inline double random_double() {
-    thread_local static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    thread_local static std::default_random_engine re;
-    return distribution(re);
+    auto& state = thread_rng();
+    return state.uniform(state.engine);
 }
 
 inline double randn_double() {
-    thread_local static std::normal_distribution<double> distribution;
-    thread_local static std::default_random_engine re;
-    return distribution(re);
+    auto& state = thread_rng();
+    return state.normal(state.engine);
 }
 
 inline double random_double(double min, double max) {
@@ -1,9 +1,10 @@
 #include <vector>
 #include "vec3.h"
+#include "framebuffer.h"
 #include "../lib/pngwriter/src/pngwriter.h"
 
 
-void write_img(std::vector<vec3>& pixel_colors, const uint32_t samples_per_pixel, pngwriter& png) {
+void write_img(pixel_buffer<color>& pixel_colors, const uint32_t samples_per_pixel, pngwriter& png) {
     auto img_height = png.getheight();
     auto img_width = png.getwidth();
     for (int j = img_height - 1; j >= 0; --j) {
@@ -13,9 +14,10 @@ void write_img(std::vector<vec3>& pixel_colors, const uint32_t samples_per_pixel
             auto g = pixel_color.y();
             auto b = pixel_color.z();
             auto scale = 1. / samples_per_pixel;
-            r = sqrt(scale * r);
-            g = sqrt(scale * g);
-            b = sqrt(scale * b);
+            // Spectral estimates can be slightly negative for saturated colors
+            r = sqrt(fmax(0., scale * r));
+            g = sqrt(fmax(0., scale * g));
+            b = sqrt(fmax(0., scale * b));
             png.plot(i, j, r, g, b);
         }
     }